@@ -0,0 +1,494 @@
+//
+// Copyright [2020] <inhzus>
+//
+// Throughput and allocations of stream pipelines next to the same work done
+// by a hand-written loop, a FusedStream and, in C++20, std::ranges. Prints
+// one CSV row per pipeline, implementation, element type and size:
+//
+//   pipeline,impl,type,size,runs,ns_per_element,allocations_per_run
+//
+// Every implementation of a case must produce the same checksum as the loop;
+// the benchmark exits with 1 if one does not. An optional argument sets the
+// minimum time spent on a case, in milliseconds.
+
+#define STREAM_COUNT_ALLOCATIONS
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <string>
+#include <unordered_set>
+#include <vector>
+#if __has_include(<ranges>)
+#include <ranges>
+#endif
+
+#include "../../stream/columnar.h"
+#include "../../stream/fused.h"
+#include "../../stream/profile.h"
+#include "../../stream/stream.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr size_t kTopK = 10;
+constexpr size_t kSmallBatch = 16;
+
+std::chrono::milliseconds min_time(200);
+bool failed = false;
+// A record of 32 fields of which the pipelines read two.
+struct Wide {
+  int64_t head[15];
+  int64_t price;
+  int64_t tail[15];
+  int64_t quantity;
+};
+
+// written after every run so the runs are not optimized out
+volatile int64_t sink;
+
+int64_t Weight(int64_t val) { return val; }
+int64_t Weight(const std::string &val) {
+  return static_cast<int64_t>(val.size());
+}
+
+template <typename T>
+const char *TypeName();
+template <>
+const char *TypeName<int64_t>() {
+  return "int64";
+}
+template <>
+const char *TypeName<std::string>() {
+  return "string";
+}
+template <>
+const char *TypeName<Wide>() {
+  return "wide";
+}
+
+// Distinct elements are about a quarter of `len`.
+template <typename T>
+std::vector<T> MakeInput(size_t len) {
+  std::vector<T> vals;
+  vals.reserve(len);
+  for (size_t i = 0; i < len; ++i) {
+    auto val = static_cast<int64_t>(i * 7919 % (len / 4 + 1));
+    if constexpr (std::is_same_v<T, std::string>) {
+      vals.push_back(std::to_string(val));
+    } else {
+      vals.push_back(val);
+    }
+  }
+  return vals;
+}
+
+// Runs `func` for at least min_time and prints its row. The loop runs first
+// and sets `expected`.
+template <typename T, typename Func>
+void Run(const char *pipeline, const char *impl, size_t len,
+         int64_t *expected, Func func) {
+  int64_t checksum = func();
+  if (std::string(impl) == "loop") {
+    *expected = checksum;
+  } else if (checksum != *expected) {
+    std::fprintf(stderr, "%s/%s/%s/%zu: checksum %lld, loop %lld\n",
+                 pipeline, impl, TypeName<T>(), len,
+                 static_cast<long long>(checksum),
+                 static_cast<long long>(*expected));
+    failed = true;
+  }
+  size_t runs = 0;
+  size_t allocations = ThreadAllocations();
+  auto start = Clock::now();
+  auto elapsed = Clock::duration::zero();
+  while (elapsed < min_time) {
+    sink = func();
+    ++runs;
+    elapsed = Clock::now() - start;
+  }
+  allocations = ThreadAllocations() - allocations;
+  auto nanos = std::chrono::duration<double, std::nano>(elapsed).count();
+  std::printf("%s,%s,%s,%zu,%zu,%.3f,%.1f\n", pipeline, impl, TypeName<T>(),
+              len, runs, nanos / static_cast<double>(runs * len),
+              static_cast<double>(allocations) / static_cast<double>(runs));
+}
+
+void MapFilterReduce(const std::vector<int64_t> &vals) {
+  auto map = [](int64_t val) { return val * 3; };
+  auto filter = [](int64_t val) { return val % 7 != 0; };
+  auto sum = [](int64_t lhs, int64_t rhs) { return lhs + rhs; };
+  const char *name = "map_filter_reduce";
+  size_t len = vals.size();
+  int64_t expected = 0;
+  Run<int64_t>(name, "loop", len, &expected, [&]() {
+    int64_t acc = 0;
+    for (auto val : vals) {
+      auto mapped = map(val);
+      if (filter(mapped)) acc += mapped;
+    }
+    return acc;
+  });
+  Run<int64_t>(name, "stream", len, &expected, [&]() {
+    return Stream(&vals).Map(map).Filter(filter).Reduce(sum);
+  });
+  Run<int64_t>(name, "fused", len, &expected, [&]() {
+    return FusedStream(&vals).Map(map).Filter(filter).Reduce(sum);
+  });
+#if defined(__cpp_lib_ranges)
+  Run<int64_t>(name, "ranges", len, &expected, [&]() {
+    int64_t acc = 0;
+    for (auto val :
+         vals | std::views::transform(map) | std::views::filter(filter)) {
+      acc += val;
+    }
+    return acc;
+  });
+#endif
+}
+
+template <typename T>
+int64_t TopChecksum(const std::vector<T> &top) {
+  int64_t checksum = static_cast<int64_t>(top.size());
+  for (const auto &val : top) checksum = checksum * 31 + Weight(val);
+  return checksum;
+}
+
+template <typename T>
+void SortLimit(const std::vector<T> &vals) {
+  const char *name = "sort_limit";
+  size_t len = vals.size();
+  int64_t expected = 0;
+  Run<T>(name, "loop", len, &expected, [&]() {
+    std::vector<T> top(std::min(kTopK, len));
+    std::partial_sort_copy(vals.begin(), vals.end(), top.begin(), top.end());
+    return TopChecksum(top);
+  });
+  Run<T>(name, "stream", len, &expected, [&]() {
+    return TopChecksum(Stream(&vals).Sort().Limit(kTopK).Collect());
+  });
+  Run<T>(name, "fused", len, &expected, [&]() {
+    return TopChecksum(FusedStream(&vals).TopK(kTopK).Collect());
+  });
+#if defined(__cpp_lib_ranges)
+  Run<T>(name, "ranges", len, &expected, [&]() {
+    std::vector<T> top(std::min(kTopK, len));
+    std::ranges::partial_sort_copy(vals, top);
+    return TopChecksum(top);
+  });
+#endif
+}
+
+template <typename T>
+void Distinct(const std::vector<T> &vals) {
+  const char *name = "distinct";
+  size_t len = vals.size();
+  int64_t expected = 0;
+  Run<T>(name, "loop", len, &expected, [&]() {
+    std::unordered_set<T> seen;
+    for (const auto &val : vals) seen.insert(val);
+    return static_cast<int64_t>(seen.size());
+  });
+  Run<T>(name, "stream", len, &expected, [&]() {
+    return static_cast<int64_t>(Stream(&vals).Distinct().Count());
+  });
+  Run<T>(name, "fused", len, &expected, [&]() {
+    return static_cast<int64_t>(FusedStream(&vals).Distinct().Count());
+  });
+#if defined(__cpp_lib_ranges)
+  Run<T>(name, "ranges", len, &expected, [&]() {
+    std::vector<T> sorted(vals);
+    std::ranges::sort(sorted);
+    return static_cast<int64_t>(sorted.size() -
+                                std::ranges::unique(sorted).size());
+  });
+#endif
+}
+
+void FlatMap(const std::vector<int64_t> &vals) {
+  auto expand = [](int64_t val) { return std::array<int64_t, 2>{val, -val}; };
+  // not commutative, so the order of the items is checked too
+  auto fold = [](int64_t acc, int64_t item) {
+    return static_cast<int64_t>(static_cast<uint64_t>(acc) * 3 +
+                                static_cast<uint64_t>(item));
+  };
+  const char *name = "flat_map";
+  size_t len = vals.size();
+  int64_t expected = 0;
+  Run<int64_t>(name, "loop", len, &expected, [&]() {
+    int64_t acc = 0;
+    for (auto val : vals) {
+      for (auto item : expand(val)) acc = fold(acc, item);
+    }
+    return acc;
+  });
+  Run<int64_t>(name, "stream", len, &expected, [&]() {
+    int64_t acc = 0;
+    Stream(&vals).FlatMap(expand).ForEach(
+        [&acc, &fold](int64_t item) { acc = fold(acc, item); });
+    return acc;
+  });
+  Run<int64_t>(name, "fused", len, &expected, [&]() {
+    int64_t acc = 0;
+    FusedStream(&vals).FlatMap(expand).ForEach(
+        [&acc, &fold](int64_t item) { acc = fold(acc, item); });
+    return acc;
+  });
+#if defined(__cpp_lib_ranges)
+  Run<int64_t>(name, "ranges", len, &expected, [&]() {
+    int64_t acc = 0;
+    for (auto item : vals | std::views::transform(expand) | std::views::join) {
+      acc = fold(acc, item);
+    }
+    return acc;
+  });
+#endif
+}
+
+// Map() to another type goes through a CastSink.
+template <typename T>
+void CastMap(const std::vector<T> &vals) {
+  auto cast = [](const T &val) { return static_cast<double>(Weight(val)); };
+  auto sum = [](double lhs, double rhs) { return lhs + rhs; };
+  const char *name = "cast_map";
+  size_t len = vals.size();
+  int64_t expected = 0;
+  Run<T>(name, "loop", len, &expected, [&]() {
+    double acc = 0;
+    for (const auto &val : vals) acc += cast(val);
+    return static_cast<int64_t>(acc);
+  });
+  Run<T>(name, "stream", len, &expected, [&]() {
+    return static_cast<int64_t>(Stream(&vals).Map(cast).Reduce(sum));
+  });
+  Run<T>(name, "fused", len, &expected, [&]() {
+    return static_cast<int64_t>(FusedStream(&vals).Map(cast).Reduce(sum));
+  });
+#if defined(__cpp_lib_ranges)
+  Run<T>(name, "ranges", len, &expected, [&]() {
+    double acc = 0;
+    for (auto val : vals | std::views::transform(cast)) acc += val;
+    return static_cast<int64_t>(acc);
+  });
+#endif
+}
+
+// Pulls elements through Stream::Iterator instead of pushing them.
+template <typename T>
+void Iterate(const std::vector<T> &vals) {
+  auto filter = [](const T &val) { return Weight(val) % 2 == 0; };
+  const char *name = "iterator";
+  size_t len = vals.size();
+  int64_t expected = 0;
+  Run<T>(name, "loop", len, &expected, [&]() {
+    int64_t acc = 0;
+    for (const auto &val : vals) {
+      if (filter(val)) acc += Weight(val);
+    }
+    return acc;
+  });
+  Run<T>(name, "stream", len, &expected, [&]() {
+    int64_t acc = 0;
+    for (const auto &val : Stream(&vals).Filter(filter)) acc += Weight(val);
+    return acc;
+  });
+#if defined(__cpp_lib_ranges)
+  Run<T>(name, "ranges", len, &expected, [&]() {
+    int64_t acc = 0;
+    for (const auto &val : vals | std::views::filter(filter)) {
+      acc += Weight(val);
+    }
+    return acc;
+  });
+#endif
+}
+
+// Reads two fields of wide records, row by row or as columns.
+void WideRecord(size_t len) {
+  std::vector<Wide> rows(len);
+  for (size_t i = 0; i < len; ++i) {
+    rows[i].price = static_cast<int64_t>(i % 1000);
+    rows[i].quantity = static_cast<int64_t>(i % 7);
+  }
+  auto filter = [](int64_t quantity) { return quantity > 2; };
+  auto total = [](int64_t price, int64_t quantity) { return price * quantity; };
+  auto sum = [](int64_t lhs, int64_t rhs) { return lhs + rhs; };
+  const char *name = "wide_record";
+  int64_t expected = 0;
+  Run<Wide>(name, "loop", len, &expected, [&]() {
+    int64_t acc = 0;
+    for (const auto &row : rows) {
+      if (filter(row.quantity)) acc += total(row.price, row.quantity);
+    }
+    return acc;
+  });
+  Run<Wide>(name, "stream", len, &expected, [&]() {
+    return Stream(&rows)
+        .Filter([&](const Wide &row) { return filter(row.quantity); })
+        .Map([&](const Wide &row) { return total(row.price, row.quantity); })
+        .Reduce(sum);
+  });
+  Run<Wide>(name, "fused", len, &expected, [&]() {
+    return FusedStream(&rows)
+        .Filter([&](const Wide &row) { return filter(row.quantity); })
+        .Map([&](const Wide &row) { return total(row.price, row.quantity); })
+        .Reduce(sum);
+  });
+  Run<Wide>(name, "columnar", len, &expected, [&]() {
+    return ColumnarStream(&rows, &Wide::price, &Wide::quantity)
+        .Filter<1>(filter)
+        .Map<0, 1>(total)
+        .Reduce<2>(sum);
+  });
+}
+
+// The same pipeline over many batches of kSmallBatch elements, built for
+// every batch or prepared once.
+void SmallBatches(const std::vector<int64_t> &vals) {
+  auto map = [](int64_t val) { return val * 3; };
+  auto filter = [](int64_t val) { return val % 7 != 0; };
+  const char *name = "small_batches";
+  size_t len = vals.size();
+  auto batch = [&vals, len](size_t lo) {
+    const int64_t *first = vals.data() + lo;
+    return Slice(first, first + std::min(kSmallBatch, len - lo));
+  };
+  int64_t expected = 0;
+  Run<int64_t>(name, "loop", len, &expected, [&]() {
+    int64_t acc = 0;
+    std::unordered_set<int64_t> seen;
+    for (size_t lo = 0; lo < len; lo += kSmallBatch) {
+      seen.clear();
+      for (auto val : batch(lo)) {
+        if (filter(map(val))) seen.insert(map(val));
+      }
+      acc += static_cast<int64_t>(seen.size());
+    }
+    return acc;
+  });
+  Run<int64_t>(name, "stream", len, &expected, [&]() {
+    int64_t acc = 0;
+    for (size_t lo = 0; lo < len; lo += kSmallBatch) {
+      acc += static_cast<int64_t>(
+          Stream(batch(lo)).Map(map).Filter(filter).Distinct().Count());
+    }
+    return acc;
+  });
+  auto prepared =
+      Stream(batch(0)).Map(map).Filter(filter).Distinct().Prepare();
+  Run<int64_t>(name, "prepared", len, &expected, [&]() {
+    int64_t acc = 0;
+    for (size_t lo = 0; lo < len; lo += kSmallBatch) {
+      acc += static_cast<int64_t>(prepared.Count(batch(lo)));
+    }
+    return acc;
+  });
+}
+
+// Three statistics of one sorted, mapped stream: recomputed for each, read
+// back from a Collect()ed vector, or from a Cache().
+void Statistics(const std::vector<int64_t> &vals) {
+  auto map = [](int64_t val) { return val * 3 % 1009; };
+  auto sum = [](int64_t lhs, int64_t rhs) { return lhs + rhs; };
+  const char *name = "statistics";
+  size_t len = vals.size();
+  auto stats = [](int64_t cnt, int64_t distinct, int64_t total) {
+    return cnt + distinct * 31 + total * 961;
+  };
+  int64_t expected = 0;
+  Run<int64_t>(name, "loop", len, &expected, [&]() {
+    std::vector<int64_t> sorted;
+    sorted.reserve(len);
+    for (auto val : vals) sorted.push_back(map(val));
+    std::sort(sorted.begin(), sorted.end());
+    int64_t total = 0;
+    for (auto val : sorted) total += val;
+    auto distinct = std::unique(sorted.begin(), sorted.end()) - sorted.begin();
+    return stats(static_cast<int64_t>(len), distinct, total);
+  });
+  Run<int64_t>(name, "stream", len, &expected, [&]() {
+    auto cnt = Stream(&vals).Map(map).Sort().Count();
+    auto distinct = Stream(&vals).Map(map).Sort().Distinct().Count();
+    auto total = Stream(&vals).Map(map).Sort().Reduce(sum);
+    return stats(static_cast<int64_t>(cnt), static_cast<int64_t>(distinct),
+                 total);
+  });
+  Run<int64_t>(name, "collect", len, &expected, [&]() {
+    auto sorted = Stream(&vals).Map(map).Sort().Collect();
+    auto cnt = Stream(&sorted).Count();
+    auto distinct = Stream(&sorted).Distinct().Count();
+    auto total = Stream(&sorted).Reduce(sum);
+    return stats(static_cast<int64_t>(cnt), static_cast<int64_t>(distinct),
+                 total);
+  });
+  Run<int64_t>(name, "cache", len, &expected, [&]() {
+    auto cache = Stream(&vals).Map(map).Sort().Cache();
+    auto cnt = cache.Replay().Count();
+    auto distinct = cache.Replay().Distinct().Count();
+    auto total = cache.Replay().Reduce(sum);
+    return stats(static_cast<int64_t>(cnt), static_cast<int64_t>(distinct),
+                 total);
+  });
+}
+
+// Parsing then scoring in encounter order, one after the other or on two
+// threads with a Handoff() between them.
+void ParseScore(const std::vector<std::string> &vals) {
+  auto parse = [](const std::string &val) { return std::stoll(val); };
+  auto score = [](int64_t val) {
+    uint64_t acc = static_cast<uint64_t>(val);
+    for (int i = 0; i < 16; ++i) acc = acc * 6364136223846793005u + 1;
+    return static_cast<int64_t>(acc >> 48);
+  };
+  // not commutative, so the order of the scores is checked too
+  auto fold = [](int64_t acc, int64_t val) {
+    return static_cast<int64_t>(static_cast<uint64_t>(acc) * 31 +
+                                static_cast<uint64_t>(val));
+  };
+  const char *name = "parse_score";
+  size_t len = vals.size();
+  int64_t expected = 0;
+  Run<std::string>(name, "loop", len, &expected, [&]() {
+    int64_t acc = 0;
+    for (const auto &val : vals) acc = fold(acc, score(parse(val)));
+    return acc;
+  });
+  Run<std::string>(name, "stream", len, &expected, [&]() {
+    return Stream(&vals).Map(parse).Map(score).Reduce(fold);
+  });
+  Run<std::string>(name, "handoff", len, &expected, [&]() {
+    return Stream(&vals).Map(parse).Handoff().Map(score).Reduce(fold);
+  });
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  if (argc > 1) min_time = std::chrono::milliseconds(std::atol(argv[1]));
+  std::printf(
+      "pipeline,impl,type,size,runs,ns_per_element,allocations_per_run\n");
+  for (size_t len : {size_t(1) << 10, size_t(1) << 14, size_t(1) << 18}) {
+    auto ints = MakeInput<int64_t>(len);
+    auto strings = MakeInput<std::string>(len);
+    MapFilterReduce(ints);
+    SortLimit(ints);
+    SortLimit(strings);
+    Distinct(ints);
+    Distinct(strings);
+    FlatMap(ints);
+    CastMap(ints);
+    CastMap(strings);
+    Iterate(ints);
+    Iterate(strings);
+    WideRecord(len);
+    SmallBatches(ints);
+    Statistics(ints);
+    ParseScore(strings);
+  }
+  return failed ? 1 : 0;
+}
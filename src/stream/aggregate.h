@@ -0,0 +1,82 @@
+//
+// Copyright [2020] <inhzus>
+//
+#ifndef TOYS_STREAM_AGGREGATE_H_
+#define TOYS_STREAM_AGGREGATE_H_
+
+#include <cstddef>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Aggregators of GroupBy. Each one starts a group's accumulator from its first
+// element with Init(val), folds in later elements with Add(acc, val), and
+// combines the accumulators of two partial tables with Merge(acc, other).
+
+struct Counting {
+  template <typename T>
+  size_t Init(const T &) const {
+    return 1;
+  }
+  template <typename T>
+  void Add(size_t &acc, const T &) const {
+    ++acc;
+  }
+  void Merge(size_t &acc, size_t other) const { acc += other; }
+};
+
+template <typename Func>
+struct Summing {
+  explicit Summing(Func func) : func(std::move(func)) {}
+  template <typename T>
+  auto Init(const T &val) const {
+    return func(val);
+  }
+  template <typename A, typename T>
+  void Add(A &acc, const T &val) const {
+    acc += func(val);
+  }
+  template <typename A>
+  void Merge(A &acc, A &&other) const {
+    acc += other;
+  }
+  Func func;
+};
+
+// Folds with select(acc, val) like Stream::Reduce.
+template <typename Func>
+struct Reducing {
+  explicit Reducing(Func select) : select(std::move(select)) {}
+  template <typename T>
+  T Init(const T &val) const {
+    return val;
+  }
+  template <typename T>
+  void Add(T &acc, const T &val) const {
+    acc = select(acc, val);
+  }
+  template <typename T>
+  void Merge(T &acc, T &&other) const {
+    acc = select(acc, other);
+  }
+  Func select;
+};
+
+struct Collecting {
+  template <typename T>
+  std::vector<T> Init(const T &val) const {
+    return std::vector<T>{val};
+  }
+  template <typename T>
+  void Add(std::vector<T> &acc, const T &val) const {
+    acc.push_back(val);
+  }
+  template <typename T>
+  void Merge(std::vector<T> &acc, std::vector<T> &&other) const {
+    acc.insert(acc.end(), std::make_move_iterator(other.begin()),
+               std::make_move_iterator(other.end()));
+  }
+};
+
+#endif  // TOYS_STREAM_AGGREGATE_H_
@@ -0,0 +1,76 @@
+//
+// Copyright [2020] <inhzus>
+//
+#ifndef TOYS_STREAM_ARENA_H_
+#define TOYS_STREAM_ARENA_H_
+
+#include <cstddef>
+#include <memory_resource>
+
+// Forwards to `upstream` and counts what passes through, e.g. to check how
+// many allocations building and running a pipeline costs.
+class CountingResource : public std::pmr::memory_resource {
+ public:
+  explicit CountingResource(
+      std::pmr::memory_resource *upstream = std::pmr::new_delete_resource())
+      : upstream_(upstream), allocations_(0), bytes_(0) {}
+
+  [[nodiscard]] size_t allocations() const { return allocations_; }
+  [[nodiscard]] size_t bytes() const { return bytes_; }
+
+ private:
+  void *do_allocate(size_t bytes, size_t align) override {
+    ++allocations_;
+    bytes_ += bytes;
+    return upstream_->allocate(bytes, align);
+  }
+  void do_deallocate(void *ptr, size_t bytes, size_t align) override {
+    upstream_->deallocate(ptr, bytes, align);
+  }
+  [[nodiscard]] bool do_is_equal(
+      const std::pmr::memory_resource &other) const noexcept override {
+    return this == &other;
+  }
+
+  std::pmr::memory_resource *upstream_;
+  size_t allocations_;
+  size_t bytes_;
+};
+
+// Monotonic arena for short-lived pipelines: the stages and sink chains of
+// every Stream built on it are carved out of an inline buffer of N bytes and
+// released all at once when the arena is destroyed or Release()d. Only when
+// the buffer runs out does it fall back to the heap.
+template <size_t N = 4096>
+class StreamArena : public std::pmr::memory_resource {
+ public:
+  StreamArena() : pool_(buf_, N, &heap_), counter_(&pool_) {}
+  StreamArena(const StreamArena &) = delete;
+  StreamArena &operator=(const StreamArena &) = delete;
+
+  void Release() { pool_.release(); }
+  // Allocations made by pipelines on this arena.
+  [[nodiscard]] size_t allocations() const { return counter_.allocations(); }
+  [[nodiscard]] size_t bytes() const { return counter_.bytes(); }
+  // Allocations the arena had to make on the heap itself.
+  [[nodiscard]] size_t heap_allocations() const { return heap_.allocations(); }
+
+ private:
+  void *do_allocate(size_t bytes, size_t align) override {
+    return counter_.allocate(bytes, align);
+  }
+  void do_deallocate(void *ptr, size_t bytes, size_t align) override {
+    counter_.deallocate(ptr, bytes, align);
+  }
+  [[nodiscard]] bool do_is_equal(
+      const std::pmr::memory_resource &other) const noexcept override {
+    return this == &other;
+  }
+
+  alignas(std::max_align_t) std::byte buf_[N];
+  CountingResource heap_;
+  std::pmr::monotonic_buffer_resource pool_;
+  CountingResource counter_;
+};
+
+#endif  // TOYS_STREAM_ARENA_H_
@@ -0,0 +1,164 @@
+//
+// Copyright [2020] <inhzus>
+//
+#ifndef TOYS_STREAM_CACHE_H_
+#define TOYS_STREAM_CACHE_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "./sink.h"
+#include "./spill.h"
+
+template <typename R, typename T>
+class Stream;
+
+// What a Stream knew about its elements when it was cached, so the streams
+// replaying them know it too, e.g. that they are sorted already.
+struct CachedCharacteristics {
+  size_t threads;
+  bool ordered;
+  unsigned flags;
+  const void *order;
+};
+
+// The elements of a Stream evaluated once by Stream::Cache(), to be streamed
+// again by any number of terminals without running the stages before them.
+// Replay() starts a Stream over them, which keeps the characteristics and
+// the Parallel() settings of the cached one. A cache is also a range, so
+// Stream(&cache) works too.
+//
+// Without a Serializer the elements stay in one contiguous buffer. With one,
+// at most `budget` bytes of them are kept in memory and the rest is spilled to
+// a temporary file; only one stream at a time may read such a cache.
+template <typename T, typename Serializer = void>
+class StreamCache {
+ public:
+  // its iterators only read on, but it knows how many elements it holds
+  static constexpr bool kSized = true;
+
+  class Iterator {
+   public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const T *;
+    using reference = const T &;
+
+    Iterator() : cache_(nullptr), spilled_(false), pos_(0) {}
+    Iterator(const StreamCache *cache, size_t pos)
+        : cache_(cache), spilled_(false), pos_(pos) {}
+
+    const T &operator*() const {
+      return spilled_ ? cache_->run_->head() : cache_->vals_[pos_];
+    }
+    const T *operator->() const { return &**this; }
+    Iterator &operator++() {
+      if (!spilled_) {
+        ++pos_;
+      } else if (!cache_->run_->Next()) {
+        spilled_ = false;
+      }
+      return *this;
+    }
+    void operator++(int) { ++*this; }
+    bool operator==(const Iterator &it) const {
+      return spilled_ == it.spilled_ && (spilled_ || pos_ == it.pos_);
+    }
+    bool operator!=(const Iterator &it) const { return !operator==(it); }
+
+   private:
+    friend class StreamCache;
+
+    const StreamCache *cache_;
+    // reading the file, before the elements left in memory
+    bool spilled_;
+    size_t pos_;
+  };
+
+  StreamCache(size_t budget, Serializer serializer,
+              CachedCharacteristics cached)
+      : max_(std::max<size_t>(1, budget / sizeof(T))),
+        len_(0),
+        serializer_(std::move(serializer)),
+        cached_(cached) {}
+
+  [[nodiscard]] Iterator begin() const {
+    Iterator it(this, 0);
+    it.spilled_ = run_.has_value() && run_->Rewind();
+    return it;
+  }
+  [[nodiscard]] Iterator end() const { return Iterator(this, vals_.size()); }
+  [[nodiscard]] size_t size() const { return len_; }
+  [[nodiscard]] bool spilled() const { return run_.has_value(); }
+
+  [[nodiscard]] Stream<const StreamCache *, T> Replay() const {
+    return Stream<const StreamCache *, T>(this, cached_);
+  }
+
+ private:
+  template <typename, typename>
+  friend class CacheSink;
+
+  void reserve(size_t len) { vals_.reserve(std::min(len, max_)); }
+  template <typename V>
+  void Put(V &&val) {
+    vals_.emplace_back(std::forward<V>(val));
+    ++len_;
+    if (vals_.size() < max_) return;
+    if (!run_.has_value()) run_.emplace(serializer_);
+    run_->Write(vals_.data(), vals_.size());
+    vals_.clear();
+  }
+
+  size_t max_;
+  size_t len_;
+  Serializer serializer_;
+  CachedCharacteristics cached_;
+  // the elements after those in the file
+  std::vector<T> vals_;
+  // read by const iterators, which only move its cursor
+  mutable std::optional<SpillRun<T, Serializer>> run_;
+};
+
+template <typename T>
+class StreamCache<T, void> {
+ public:
+  StreamCache(std::vector<T> &&vals, CachedCharacteristics cached)
+      : vals_(std::move(vals)), cached_(cached) {}
+
+  [[nodiscard]] auto begin() const { return vals_.begin(); }
+  [[nodiscard]] auto end() const { return vals_.end(); }
+  [[nodiscard]] const T *data() const { return vals_.data(); }
+  [[nodiscard]] size_t size() const { return vals_.size(); }
+
+  [[nodiscard]] Stream<const StreamCache *, T> Replay() const {
+    return Stream<const StreamCache *, T>(this, cached_);
+  }
+
+ private:
+  std::vector<T> vals_;
+  CachedCharacteristics cached_;
+};
+
+// Terminal of Stream::Cache() with a budget. The cache is filled in encounter
+// order, so forks buffer their elements for it.
+template <typename T, typename Serializer>
+class CacheSink : public FinalSink<T> {
+ public:
+  explicit CacheSink(StreamCache<T, Serializer> *cache)
+      : FinalSink<T>(), cache_(cache) {}
+  void Pre(Extent ext) final { cache_->reserve(ext.Reserve()); }
+  void Accept(const T &val) final { cache_->Put(val); }
+  void Accept(T &&val) final { cache_->Put(std::move(val)); }
+  void Post() final {}
+
+ private:
+  StreamCache<T, Serializer> *cache_;
+};
+
+#endif  // TOYS_STREAM_CACHE_H_
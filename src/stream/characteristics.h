@@ -0,0 +1,101 @@
+//
+// Copyright [2020] <inhzus>
+//
+#ifndef TOYS_STREAM_CHARACTERISTICS_H_
+#define TOYS_STREAM_CHARACTERISTICS_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <limits>
+#include <type_traits>
+
+#include "./traits.h"
+
+// What a stage is told about the elements it is about to receive: exactly
+// `len` of them if `sized`, else at most `len`.
+struct Extent {
+  static constexpr size_t kUnbounded = std::numeric_limits<size_t>::max();
+  // A bound says little about how many elements will actually come, so only
+  // this much of it is reserved up front.
+  static constexpr size_t kMaxBoundReserve = 1 << 16;
+
+  static Extent Exactly(size_t len) { return {len, true}; }
+  static Extent Unknown() { return {kUnbounded, false}; }
+
+  // What is left after dropping any of the elements, e.g. by a Filter.
+  [[nodiscard]] Extent Bound() const { return {len, false}; }
+  [[nodiscard]] Extent Limit(size_t max) const {
+    return {std::min(len, max), sized};
+  }
+  [[nodiscard]] Extent Skip(size_t skip) const {
+    if (len == kUnbounded) return *this;
+    return {len > skip ? len - skip : 0, sized};
+  }
+  // How many elements are worth reserving room for.
+  [[nodiscard]] size_t Reserve() const {
+    if (sized) return len;
+    return len == kUnbounded ? 0 : std::min(len, kMaxBoundReserve);
+  }
+
+  size_t len;
+  bool sized;
+};
+
+// A source's size() is taken as its exact length if its iterators are random
+// access, or if it declares `static constexpr bool kSized = true`. Others may
+// use size() as a mere hint, or 0 for unknown, so their length is unknown;
+// `kSized = false` says so for a random access source.
+template <typename C, typename = void>
+struct is_random_access_sized : std::false_type {};
+template <typename C>
+struct is_random_access_sized<
+    C, std::void_t<decltype(std::declval<const C &>().size())>>
+    : std::bool_constant<is_random_access_v<decltype(std::begin(
+          std::declval<const C &>()))>> {};
+
+template <typename C, typename = void>
+struct is_sized : is_random_access_sized<C> {};
+template <typename C>
+struct is_sized<C, std::void_t<decltype(C::kSized)>>
+    : std::bool_constant<C::kSized> {};
+template <typename C>
+inline constexpr bool is_sized_v = is_sized<C>::value;
+
+template <typename C>
+Extent SourceExtent(const C &range) {
+  if constexpr (is_sized_v<C>) {
+    return Extent::Exactly(range.size());
+  } else {
+    return Extent::Unknown();
+  }
+}
+
+// Characteristics a Stream tracks while stages are appended.
+enum Characteristic : unsigned {
+  kSorted = 1 << 0,
+  kDistinct = 1 << 1,
+};
+
+template <typename Tag>
+const void *TypeTag() {
+  static const char tag = 0;
+  return &tag;
+}
+
+// Identifies the order Less sorts in, so a stream can tell it is sorted by it
+// already. std::less<T> and std::less<> are the same order; a comparator with
+// state has no identity, and nullptr never matches.
+template <typename T, typename Less>
+const void *OrderOf() {
+  if constexpr (std::is_same_v<Less, std::less<T>> ||
+                std::is_same_v<Less, std::less<>>) {
+    return TypeTag<std::less<>>();
+  } else if constexpr (std::is_empty_v<Less>) {
+    return TypeTag<Less>();
+  } else {
+    return nullptr;
+  }
+}
+
+#endif  // TOYS_STREAM_CHARACTERISTICS_H_
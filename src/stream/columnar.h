@@ -0,0 +1,344 @@
+//
+// Copyright [2020] <inhzus>
+//
+#ifndef TOYS_STREAM_COLUMNAR_H_
+#define TOYS_STREAM_COLUMNAR_H_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "./characteristics.h"
+#include "./fused.h"
+#include "./sink.h"
+
+// Rows of a ColumnarStream pass between stages kBatchSize at a time, as one
+// array per column and a bitmap of the rows still selected.
+inline constexpr size_t kSelectionWords = (kBatchSize + 63) / 64;
+
+template <typename... Cols>
+struct ColumnBatch {
+  template <size_t I>
+  const auto *column() const {
+    return std::get<I>(cols);
+  }
+
+  size_t len;
+  // bit i % 64 of word i / 64 is set if row i is selected
+  const uint64_t *selection;
+  std::tuple<const Cols *...> cols;
+};
+
+// Calls func(row) for every selected row of a batch; rows of fully selected
+// words go through a loop without branches on the bitmap.
+template <typename Func>
+void ForEachSelected(const uint64_t *selection, size_t len, Func func) {
+  for (size_t base = 0; base < len; base += 64) {
+    uint64_t bits = selection[base / 64];
+    if (bits == ~uint64_t(0)) {
+      for (size_t row = base; row < base + 64; ++row) func(row);
+    } else {
+      for (; bits != 0; bits &= bits - 1) func(base + __builtin_ctzll(bits));
+    }
+  }
+}
+
+// Stages of a ColumnarStream, fused by value like those of a FusedStream.
+// `Is` are the indices of the columns a stage reads.
+
+template <typename Func, typename Next, size_t... Is>
+class ColumnFilter {
+ public:
+  ColumnFilter(Func func, Next next)
+      : func_(std::move(func)), next_(std::move(next)) {}
+  void Pre(Extent ext) { next_.Pre(ext.Bound()); }
+  template <typename... Cols>
+  void Accept(const ColumnBatch<Cols...> &batch) {
+    uint64_t any = 0;
+    for (size_t base = 0; base < batch.len; base += 64) {
+      uint64_t bits = batch.selection[base / 64];
+      if (bits == ~uint64_t(0)) {
+        bits = 0;
+        for (size_t i = 0; i < 64; ++i) {
+          bits |= uint64_t(Test(batch, base + i)) << i;
+        }
+      } else {
+        for (uint64_t rest = bits; rest != 0; rest &= rest - 1) {
+          size_t i = __builtin_ctzll(rest);
+          if (!Test(batch, base + i)) bits &= ~(uint64_t(1) << i);
+        }
+      }
+      selection_[base / 64] = bits;
+      any |= bits;
+    }
+    if (any != 0) {
+      next_.Accept(ColumnBatch<Cols...>{batch.len, selection_.data(),
+                                        batch.cols});
+    }
+  }
+  void Post() { next_.Post(); }
+
+ private:
+  template <typename Batch>
+  bool Test(const Batch &batch, size_t row) {
+    return static_cast<bool>(func_(batch.template column<Is>()[row]...));
+  }
+
+  Func func_;
+  Next next_;
+  std::array<uint64_t, kSelectionWords> selection_;
+};
+
+// Adds func(columns...) of the selected rows as the last column.
+template <typename U, typename Func, typename Next, size_t... Is>
+class ColumnMap {
+ public:
+  ColumnMap(Func func, Next next)
+      : func_(std::move(func)), next_(std::move(next)), out_(kBatchSize) {}
+  void Pre(Extent ext) { next_.Pre(ext); }
+  template <typename... Cols>
+  void Accept(const ColumnBatch<Cols...> &batch) {
+    ForEachSelected(batch.selection, batch.len, [&](size_t row) {
+      out_[row] = func_(batch.template column<Is>()[row]...);
+    });
+    next_.Accept(ColumnBatch<Cols..., U>{
+        batch.len, batch.selection,
+        std::tuple_cat(batch.cols, std::tuple<const U *>(out_.data()))});
+  }
+  void Post() { next_.Post(); }
+
+ private:
+  Func func_;
+  Next next_;
+  std::vector<U> out_;
+};
+
+template <size_t I, typename U>
+class ColumnCollect {
+ public:
+  explicit ColumnCollect(std::vector<U> *vals) : vals_(vals) {}
+  void Pre(Extent ext) { vals_->reserve(ext.Reserve()); }
+  template <typename Batch>
+  void Accept(const Batch &batch) {
+    const auto *col = batch.template column<I>();
+    ForEachSelected(batch.selection, batch.len,
+                    [&](size_t row) { vals_->push_back(col[row]); });
+  }
+  void Post() {}
+
+ private:
+  std::vector<U> *vals_;
+};
+
+template <typename Func, size_t... Is>
+class ColumnForEach {
+ public:
+  explicit ColumnForEach(Func func) : func_(std::move(func)) {}
+  void Pre(Extent) {}
+  template <typename Batch>
+  void Accept(const Batch &batch) {
+    ForEachSelected(batch.selection, batch.len, [&](size_t row) {
+      func_(batch.template column<Is>()[row]...);
+    });
+  }
+  void Post() {}
+
+ private:
+  Func func_;
+};
+
+template <size_t I, typename U, typename Func>
+class ColumnReduce {
+ public:
+  ColumnReduce(Func func, std::optional<U> *val)
+      : func_(std::move(func)), val_(val) {}
+  void Pre(Extent) {}
+  template <typename Batch>
+  void Accept(const Batch &batch) {
+    const auto *col = batch.template column<I>();
+    ForEachSelected(batch.selection, batch.len, [&](size_t row) {
+      if (val_->has_value()) {
+        **val_ = func_(**val_, col[row]);
+      } else {
+        val_->emplace(col[row]);
+      }
+    });
+  }
+  void Post() {}
+
+ private:
+  Func func_;
+  std::optional<U> *val_;
+};
+
+class ColumnCount {
+ public:
+  explicit ColumnCount(size_t *cnt) : cnt_(cnt) {}
+  void Pre(Extent) {}
+  template <typename Batch>
+  void Accept(const Batch &batch) {
+    for (size_t word = 0; word * 64 < batch.len; ++word) {
+      *cnt_ += __builtin_popcountll(batch.selection[word]);
+    }
+  }
+  void Post() {}
+
+ private:
+  size_t *cnt_;
+};
+
+// Columnar execution over a range of records: only the fields named by
+// member pointers are read, batch by batch, into one array per field, and the
+// stages work on those arrays. Filter() clears bits of the selection instead
+// of moving rows, and Map() appends a column computed from the columns it
+// names, so a record is touched once however many stages follow. Columns are
+// numbered in the order of the member pointers, then of the Map() calls:
+//
+//   ColumnarStream(&orders, &Order::price, &Order::quantity)
+//       .Filter<1>([](int quantity) { return quantity > 0; })
+//       .Map<0, 1>(std::multiplies<>())
+//       .Reduce<2>(std::plus<>());
+//
+// Functions are only called on selected rows.
+template <typename R, typename Fields, typename Cols, typename Make = FusedHead>
+class ColumnarStream;
+
+template <typename R, typename... Fields, typename... Cols, typename Make>
+class ColumnarStream<R, std::tuple<Fields...>, std::tuple<Cols...>, Make> {
+ public:
+  template <typename, typename, typename, typename>
+  friend class ColumnarStream;
+
+  using Source = std::remove_pointer_t<R>;
+  template <size_t I>
+  using Col = std::tuple_element_t<I, std::tuple<Cols...>>;
+
+  explicit ColumnarStream(R &&range, Fields... fields)
+      : range_(std::move(range)), fields_(fields...), make_() {}
+  ColumnarStream(const ColumnarStream &) = delete;
+  ColumnarStream(ColumnarStream &&) = default;
+  ColumnarStream &operator=(const ColumnarStream &) = delete;
+  ColumnarStream &operator=(ColumnarStream &&) = default;
+
+  template <size_t... Is, typename Func>
+  auto Filter(Func func) {
+    static_assert(sizeof...(Is) > 0);
+    static_assert(std::is_invocable_r_v<bool, Func, const Col<Is> &...>);
+    return Then<Cols...>([func = std::move(func)](auto next) mutable {
+      return ColumnFilter<Func, decltype(next), Is...>(std::move(func),
+                                                       std::move(next));
+    });
+  }
+  template <size_t... Is, typename Func>
+  auto Map(Func func) {
+    static_assert(sizeof...(Is) > 0);
+    using U = std::decay_t<std::invoke_result_t<Func, const Col<Is> &...>>;
+    return Then<Cols..., U>([func = std::move(func)](auto next) mutable {
+      return ColumnMap<U, Func, decltype(next), Is...>(std::move(func),
+                                                       std::move(next));
+    });
+  }
+
+  template <size_t I>
+  std::vector<Col<I>> Collect() {
+    std::vector<Col<I>> vals;
+    Evaluate(ColumnCollect<I, Col<I>>(&vals));
+    return vals;
+  }
+  template <size_t... Is, typename Func>
+  void ForEach(Func func) {
+    static_assert(std::is_invocable_v<Func, const Col<Is> &...>);
+    Evaluate(ColumnForEach<Func, Is...>(std::move(func)));
+  }
+  template <size_t I, typename Func>
+  Col<I> Reduce(Func most) {
+    static_assert(
+        std::is_invocable_r_v<Col<I>, Func, const Col<I> &, const Col<I> &>);
+    std::optional<Col<I>> val;
+    Evaluate(ColumnReduce<I, Col<I>, Func>(std::move(most), &val));
+    return val.has_value() ? std::move(*val) : Col<I>();
+  }
+  size_t Count() {
+    size_t cnt = 0;
+    Evaluate(ColumnCount(&cnt));
+    return cnt;
+  }
+
+ private:
+  using Row = value_type_of<Source>;
+  template <typename F>
+  using Field = std::decay_t<decltype(std::declval<const Row &>().*
+                                      std::declval<F>())>;
+
+  ColumnarStream(R &&range, std::tuple<Fields...> fields, Make make)
+      : range_(std::move(range)),
+        fields_(std::move(fields)),
+        make_(std::move(make)) {}
+
+  template <typename... Next, typename Wrap>
+  auto Then(Wrap wrap) {
+    auto make = [make = std::move(make_), wrap = std::move(wrap)](
+                    auto next) mutable { return make(wrap(std::move(next))); };
+    return ColumnarStream<R, std::tuple<Fields...>, std::tuple<Next...>,
+                          decltype(make)>(std::move(range_), fields_,
+                                          std::move(make));
+  }
+  template <typename Final>
+  void Evaluate(Final final) {
+    auto sink = make_(std::move(final));
+    const Source &range = source();
+    sink.Pre(SourceExtent(range));
+    Scan(range, &sink, std::index_sequence_for<Fields...>());
+    sink.Post();
+  }
+  // Reads the fields of each batch of records in one pass over the records.
+  template <typename Sink, size_t... Is>
+  void Scan(const Source &range, Sink *sink, std::index_sequence<Is...>) {
+    using Batch = ColumnBatch<Field<Fields>...>;
+    // left uninitialized, every row is written before it is read
+    std::tuple<std::unique_ptr<Field<Fields>[]>...> cols(
+        std::unique_ptr<Field<Fields>[]>(new Field<Fields>[kBatchSize])...);
+    std::tuple<Field<Fields> *...> out(std::get<Is>(cols).get()...);
+    std::array<uint64_t, kSelectionWords> selection;
+    auto it = range.begin();
+    auto end = range.end();
+    while (it != end) {
+      size_t len = 0;
+      for (; len < kBatchSize && it != end; ++len, ++it) {
+        const Row &row = *it;
+        ((std::get<Is>(out)[len] = row.*std::get<Is>(fields_)), ...);
+      }
+      for (size_t word = 0; word < kSelectionWords; ++word) {
+        size_t lo = word * 64;
+        selection[word] = lo + 64 <= len  ? ~uint64_t(0)
+                          : lo >= len     ? 0
+                                          : (uint64_t(1) << (len - lo)) - 1;
+      }
+      sink->Accept(Batch{len, selection.data(), out});
+    }
+  }
+  const Source &source() const {
+    if constexpr (std::is_pointer_v<R>) {
+      return *range_;
+    } else {
+      return range_;
+    }
+  }
+
+  R range_;
+  std::tuple<Fields...> fields_;
+  Make make_;
+};
+
+template <typename R, typename Row, typename... Fs>
+ColumnarStream(R &&, Fs Row::*...)
+    ->ColumnarStream<R, std::tuple<Fs Row::*...>,
+                     std::tuple<std::remove_cv_t<Fs>...>>;
+
+#endif  // TOYS_STREAM_COLUMNAR_H_
@@ -0,0 +1,287 @@
+//
+// Copyright [2020] <inhzus>
+//
+#ifndef TOYS_STREAM_FLAT_HASH_H_
+#define TOYS_STREAM_FLAT_HASH_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Spreads every bit of `hash` over the whole word (the murmur3 finalizer), as
+// std::hash is often the identity.
+inline uint64_t MixHash(uint64_t hash) {
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+// Open-addressing table with linear probing. Values sit inline in one array,
+// next to a byte per slot holding 7 bits of the hash, so a probe compares
+// keys only on a likely match. Values are never erased one by one.
+template <typename Value, typename KeyOf, typename Hash, typename Eq>
+class FlatTable {
+ public:
+  explicit FlatTable(Hash hash = Hash(), Eq eq = Eq())
+      : hash_(std::move(hash)),
+        eq_(std::move(eq)),
+        slots_(nullptr),
+        size_(0),
+        mask_(0) {}
+  FlatTable(const FlatTable &) = delete;
+  FlatTable(FlatTable &&table) noexcept
+      : hash_(std::move(table.hash_)),
+        eq_(std::move(table.eq_)),
+        ctrl_(std::move(table.ctrl_)),
+        slots_(std::exchange(table.slots_, nullptr)),
+        size_(std::exchange(table.size_, 0)),
+        mask_(std::exchange(table.mask_, 0)) {
+    table.ctrl_.clear();
+  }
+  ~FlatTable() {
+    clear();
+    Deallocate();
+  }
+
+  [[nodiscard]] size_t size() const { return size_; }
+  [[nodiscard]] bool empty() const { return size_ == 0; }
+  [[nodiscard]] size_t capacity() const { return ctrl_.size(); }
+
+  void reserve(size_t len) {
+    size_t cap = kMinCapacity;
+    while (cap / 4 * 3 < len) cap *= 2;
+    if (cap > capacity()) Rehash(cap);
+  }
+  // Keeps the capacity.
+  void clear() {
+    for (size_t i = 0; i < ctrl_.size(); ++i) {
+      if (ctrl_[i] != 0) slots_[i].~Value();
+    }
+    std::fill(ctrl_.begin(), ctrl_.end(), 0);
+    size_ = 0;
+  }
+
+  template <typename K>
+  Value *find(const K &key) {
+    return FindHashed(MixHash(hash_(key)), key);
+  }
+  template <typename K>
+  Value *FindHashed(uint64_t hash, const K &key) {
+    if (size_ == 0) return nullptr;
+    uint8_t tag = Tag(hash);
+    for (size_t i = hash & mask_;; i = (i + 1) & mask_) {
+      if (ctrl_[i] == 0) return nullptr;
+      if (ctrl_[i] == tag && eq_(KeyOf()(slots_[i]), key)) return &slots_[i];
+    }
+  }
+  // Returns the value of `key`, constructing it from make() if absent.
+  template <typename K, typename Make>
+  std::pair<Value *, bool> FindOrInsert(const K &key, Make &&make) {
+    return FindOrInsertHashed(MixHash(hash_(key)), key,
+                              std::forward<Make>(make));
+  }
+  // `hash` is the mixed hash of `key`.
+  template <typename K, typename Make>
+  std::pair<Value *, bool> FindOrInsertHashed(uint64_t hash, const K &key,
+                                              Make &&make) {
+    if ((size_ + 1) * 4 > capacity() * 3) {
+      Rehash(std::max(kMinCapacity, capacity() * 2));
+    }
+    uint8_t tag = Tag(hash);
+    size_t i = hash & mask_;
+    for (; ctrl_[i] != 0; i = (i + 1) & mask_) {
+      if (ctrl_[i] == tag && eq_(KeyOf()(slots_[i]), key)) {
+        return {&slots_[i], false};
+      }
+    }
+    new (&slots_[i]) Value(make());
+    ctrl_[i] = tag;
+    ++size_;
+    return {&slots_[i], true};
+  }
+  template <typename Func>
+  void ForEach(Func func) {
+    for (size_t i = 0; i < ctrl_.size(); ++i) {
+      if (ctrl_[i] != 0) func(slots_[i]);
+    }
+  }
+  // Index of the first full slot at or after `i`, or capacity().
+  [[nodiscard]] size_t Next(size_t i) const {
+    while (i < ctrl_.size() && ctrl_[i] == 0) ++i;
+    return i;
+  }
+  Value &slot(size_t i) { return slots_[i]; }
+
+ private:
+  static constexpr size_t kMinCapacity = 16;
+
+  // Bits above those picking the slot, and below those FlatHashMap uses to
+  // pick a partition.
+  static uint8_t Tag(uint64_t hash) { return 0x80 | ((hash >> 40) & 0x7f); }
+
+  void Rehash(size_t cap) {
+    std::vector<uint8_t> ctrl(cap);
+    Value *slots = std::allocator<Value>().allocate(cap);
+    for (size_t i = 0; i < ctrl_.size(); ++i) {
+      if (ctrl_[i] == 0) continue;
+      uint64_t hash = MixHash(hash_(KeyOf()(slots_[i])));
+      size_t j = hash & (cap - 1);
+      while (ctrl[j] != 0) j = (j + 1) & (cap - 1);
+      new (&slots[j]) Value(std::move(slots_[i]));
+      slots_[i].~Value();
+      ctrl[j] = ctrl_[i];
+    }
+    Deallocate();
+    ctrl_.swap(ctrl);
+    slots_ = slots;
+    mask_ = cap - 1;
+  }
+  void Deallocate() {
+    if (slots_ != nullptr) {
+      std::allocator<Value>().deallocate(slots_, ctrl_.size());
+    }
+  }
+
+  Hash hash_;
+  Eq eq_;
+  std::vector<uint8_t> ctrl_;
+  Value *slots_;
+  size_t size_;
+  size_t mask_;
+};
+
+struct SetKey {
+  template <typename T>
+  const T &operator()(const T &val) const {
+    return val;
+  }
+};
+
+template <typename T, typename Hash = std::hash<T>,
+          typename Eq = std::equal_to<T>>
+class FlatHashSet : public FlatTable<T, SetKey, Hash, Eq> {
+ public:
+  using FlatTable<T, SetKey, Hash, Eq>::FlatTable;
+
+  // Returns true if `val` was not in the set yet.
+  template <typename V>
+  bool insert(V &&val) {
+    return this
+        ->FindOrInsert(val, [&val]() -> T { return std::forward<V>(val); })
+        .second;
+  }
+  bool contains(const T &val) { return this->find(val) != nullptr; }
+};
+
+struct MapKey {
+  template <typename K, typename V>
+  const K &operator()(const std::pair<K, V> &entry) const {
+    return entry.first;
+  }
+};
+
+// A FlatTable of key-value pairs split into a power of two partitions by the
+// top bits of the hash. Partitions are independent tables, so threads can
+// fill or merge different ones at the same time.
+template <typename K, typename V, typename Hash = std::hash<K>,
+          typename Eq = std::equal_to<K>>
+class FlatHashMap {
+ public:
+  using value_type = std::pair<K, V>;
+  using Table = FlatTable<value_type, MapKey, Hash, Eq>;
+
+  class Iterator {
+   public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = std::pair<K, V>;
+    using difference_type = std::ptrdiff_t;
+    using pointer = value_type *;
+    using reference = value_type &;
+
+    Iterator(FlatHashMap *map, size_t part, size_t slot)
+        : map_(map), part_(part), slot_(slot) {
+      Skip();
+    }
+    bool operator==(const Iterator &it) const {
+      return part_ == it.part_ && slot_ == it.slot_;
+    }
+    bool operator!=(const Iterator &it) const { return !operator==(it); }
+    reference operator*() const { return map_->parts_[part_].slot(slot_); }
+    pointer operator->() const { return &operator*(); }
+    Iterator &operator++() {
+      ++slot_;
+      Skip();
+      return *this;
+    }
+
+   private:
+    void Skip() {
+      auto &parts = map_->parts_;
+      for (; part_ < parts.size(); ++part_, slot_ = 0) {
+        slot_ = parts[part_].Next(slot_);
+        if (slot_ < parts[part_].capacity()) return;
+      }
+      slot_ = 0;
+    }
+
+    FlatHashMap *map_;
+    size_t part_;
+    size_t slot_;
+  };
+
+  explicit FlatHashMap(size_t partitions = 1, Hash hash = Hash(),
+                       Eq eq = Eq())
+      : hash_(hash), bits_(0) {
+    while ((size_t(1) << bits_) < partitions) ++bits_;
+    parts_.reserve(size_t(1) << bits_);
+    for (size_t i = 0; i < (size_t(1) << bits_); ++i) {
+      parts_.emplace_back(hash, eq);
+    }
+  }
+
+  [[nodiscard]] size_t size() const {
+    size_t size = 0;
+    for (const auto &part : parts_) size += part.size();
+    return size;
+  }
+  [[nodiscard]] bool empty() const { return size() == 0; }
+  void clear() {
+    for (auto &part : parts_) part.clear();
+  }
+  value_type *find(const K &key) {
+    uint64_t hash = MixHash(hash_(key));
+    return parts_[Partition(hash)].FindHashed(hash, key);
+  }
+  template <typename Make>
+  std::pair<value_type *, bool> FindOrInsert(const K &key, Make &&make) {
+    uint64_t hash = MixHash(hash_(key));
+    return parts_[Partition(hash)].FindOrInsertHashed(
+        hash, key, std::forward<Make>(make));
+  }
+  [[nodiscard]] size_t partitions() const { return parts_.size(); }
+  Table &partition(size_t i) { return parts_[i]; }
+  // The partition holding keys of mixed hash `hash`.
+  [[nodiscard]] size_t Partition(uint64_t hash) const {
+    return bits_ == 0 ? 0 : hash >> (64 - bits_);
+  }
+  const Hash &hash_function() const { return hash_; }
+
+  Iterator begin() { return Iterator(this, 0, 0); }
+  Iterator end() { return Iterator(this, parts_.size(), 0); }
+
+ private:
+  Hash hash_;
+  size_t bits_;
+  std::vector<Table> parts_;
+};
+
+#endif  // TOYS_STREAM_FLAT_HASH_H_
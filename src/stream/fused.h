@@ -0,0 +1,550 @@
+//
+// Copyright [2020] <inhzus>
+//
+#ifndef TOYS_STREAM_FUSED_H_
+#define TOYS_STREAM_FUSED_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "./aggregate.h"
+#include "./characteristics.h"
+#include "./flat_hash.h"
+#include "./hyperloglog.h"
+#include "./traits.h"
+
+// Stages of a FusedStream hold their successor by value, so the whole chain
+// is one object whose calls the compiler can inline into the source loop.
+
+template <typename Func, typename Next>
+class FusedMap {
+ public:
+  FusedMap(Func func, Next next)
+      : func_(std::move(func)), next_(std::move(next)) {}
+  void Pre(Extent ext) { next_.Pre(ext); }
+  template <typename V>
+  void Accept(V &&val) {
+    next_.Accept(InvokeForwarded(func_, std::forward<V>(val)));
+  }
+  void Post() { next_.Post(); }
+  [[nodiscard]] bool Cancelled() const { return next_.Cancelled(); }
+
+ private:
+  Func func_;
+  Next next_;
+};
+
+template <typename Func, typename Next>
+class FusedFlatMap {
+ public:
+  FusedFlatMap(Func func, Next next)
+      : func_(std::move(func)), next_(std::move(next)) {}
+  void Pre(Extent) { next_.Pre(Extent::Unknown()); }
+  template <typename V>
+  void Accept(V &&val) {
+    Expand(InvokeForwarded(func_, std::forward<V>(val)));
+  }
+  void Post() { next_.Post(); }
+  [[nodiscard]] bool Cancelled() const { return next_.Cancelled(); }
+
+ private:
+  template <typename C>
+  void Expand(C &&container) {
+    for (auto &&item : container) {
+      if (next_.Cancelled()) return;
+      if constexpr (std::is_reference_v<C>) {
+        next_.Accept(item);
+      } else {
+        next_.Accept(std::move(item));
+      }
+    }
+  }
+
+  Func func_;
+  Next next_;
+};
+
+template <typename Func, typename Next>
+class FusedFilter {
+ public:
+  FusedFilter(Func func, Next next)
+      : func_(std::move(func)), next_(std::move(next)) {}
+  void Pre(Extent ext) { next_.Pre(ext.Bound()); }
+  template <typename V>
+  void Accept(V &&val) {
+    if (func_(val)) next_.Accept(std::forward<V>(val));
+  }
+  void Post() { next_.Post(); }
+  [[nodiscard]] bool Cancelled() const { return next_.Cancelled(); }
+
+ private:
+  Func func_;
+  Next next_;
+};
+
+template <typename Func, typename Next>
+class FusedPeek {
+ public:
+  FusedPeek(Func func, Next next)
+      : func_(std::move(func)), next_(std::move(next)) {}
+  void Pre(Extent ext) { next_.Pre(ext); }
+  template <typename V>
+  void Accept(V &&val) {
+    func_(val);
+    next_.Accept(std::forward<V>(val));
+  }
+  void Post() { next_.Post(); }
+  [[nodiscard]] bool Cancelled() const { return next_.Cancelled(); }
+
+ private:
+  Func func_;
+  Next next_;
+};
+
+template <typename T, typename Less, typename Next>
+class FusedSort {
+ public:
+  FusedSort(Less less, Next next)
+      : less_(std::move(less)), next_(std::move(next)) {}
+  void Pre(Extent ext) { vals_.reserve(ext.Reserve()); }
+  template <typename V>
+  void Accept(V &&val) {
+    vals_.emplace_back(std::forward<V>(val));
+  }
+  void Post() {
+    std::sort(vals_.begin(), vals_.end(), less_);
+    next_.Pre(Extent::Exactly(vals_.size()));
+    for (auto &val : vals_) {
+      if (next_.Cancelled()) break;
+      next_.Accept(std::move(val));
+    }
+    next_.Post();
+  }
+  [[nodiscard]] bool Cancelled() const { return next_.Cancelled(); }
+
+ private:
+  Less less_;
+  Next next_;
+  std::vector<T> vals_;
+};
+
+template <typename T, typename Less, typename Next>
+class FusedTopK {
+ public:
+  FusedTopK(size_t k, Less less, Next next)
+      : k_(k), less_(std::move(less)), next_(std::move(next)) {}
+  void Pre(Extent ext) { heap_.reserve(std::min(ext.Reserve(), k_)); }
+  template <typename V>
+  void Accept(V &&val) {
+    if (heap_.size() < k_) {
+      heap_.emplace_back(std::forward<V>(val));
+      std::push_heap(heap_.begin(), heap_.end(), less_);
+    } else if (k_ > 0 && less_(val, heap_.front())) {
+      std::pop_heap(heap_.begin(), heap_.end(), less_);
+      heap_.back() = std::forward<V>(val);
+      std::push_heap(heap_.begin(), heap_.end(), less_);
+    }
+  }
+  void Post() {
+    std::sort_heap(heap_.begin(), heap_.end(), less_);
+    next_.Pre(Extent::Exactly(heap_.size()));
+    for (auto &val : heap_) {
+      if (next_.Cancelled()) break;
+      next_.Accept(std::move(val));
+    }
+    next_.Post();
+  }
+  [[nodiscard]] bool Cancelled() const { return k_ == 0 || next_.Cancelled(); }
+
+ private:
+  size_t k_;
+  Less less_;
+  Next next_;
+  std::vector<T> heap_;
+};
+
+template <typename Next>
+class FusedLimit {
+ public:
+  FusedLimit(size_t max, Next next)
+      : cnt_(0), max_(max), next_(std::move(next)) {}
+  void Pre(Extent ext) { next_.Pre(ext.Limit(max_)); }
+  template <typename V>
+  void Accept(V &&val) {
+    if (cnt_ < max_) {
+      ++cnt_;
+      next_.Accept(std::forward<V>(val));
+    }
+  }
+  void Post() { next_.Post(); }
+  [[nodiscard]] bool Cancelled() const {
+    return cnt_ >= max_ || next_.Cancelled();
+  }
+
+ private:
+  size_t cnt_;
+  size_t max_;
+  Next next_;
+};
+
+template <typename Next>
+class FusedSkip {
+ public:
+  FusedSkip(size_t skip, Next next)
+      : cnt_(0), skip_(skip), next_(std::move(next)) {}
+  void Pre(Extent ext) { next_.Pre(ext.Skip(skip_)); }
+  template <typename V>
+  void Accept(V &&val) {
+    if (cnt_ < skip_) {
+      ++cnt_;
+    } else {
+      next_.Accept(std::forward<V>(val));
+    }
+  }
+  void Post() { next_.Post(); }
+  [[nodiscard]] bool Cancelled() const { return next_.Cancelled(); }
+
+ private:
+  size_t cnt_;
+  size_t skip_;
+  Next next_;
+};
+
+template <typename T, typename Hash, typename Next>
+class FusedDistinct {
+ public:
+  FusedDistinct(Hash hash, Next next)
+      : set_(std::move(hash)), next_(std::move(next)) {}
+  void Pre(Extent ext) { next_.Pre(ext.Bound()); }
+  template <typename V>
+  void Accept(V &&val) {
+    if (set_.insert(val)) next_.Accept(std::forward<V>(val));
+  }
+  void Post() { next_.Post(); }
+  [[nodiscard]] bool Cancelled() const { return next_.Cancelled(); }
+
+ private:
+  FlatHashSet<T, Hash> set_;
+  Next next_;
+};
+
+// Terminals write their result through a pointer owned by the caller.
+
+template <typename T>
+class FusedCollect {
+ public:
+  explicit FusedCollect(std::vector<T> *vals) : vals_(vals) {}
+  void Pre(Extent ext) { vals_->reserve(ext.Reserve()); }
+  template <typename V>
+  void Accept(V &&val) {
+    vals_->emplace_back(std::forward<V>(val));
+  }
+  void Post() {}
+  [[nodiscard]] bool Cancelled() const { return false; }
+
+ private:
+  std::vector<T> *vals_;
+};
+
+template <typename Func>
+class FusedForEach {
+ public:
+  explicit FusedForEach(Func func) : func_(std::move(func)) {}
+  void Pre(Extent) {}
+  template <typename V>
+  void Accept(V &&val) {
+    InvokeForwarded(func_, std::forward<V>(val));
+  }
+  void Post() {}
+  [[nodiscard]] bool Cancelled() const { return false; }
+
+ private:
+  Func func_;
+};
+
+template <typename T, typename Func>
+class FusedReduce {
+ public:
+  FusedReduce(Func select, std::optional<T> *val)
+      : select_(std::move(select)), val_(val) {}
+  void Pre(Extent) {}
+  template <typename V>
+  void Accept(V &&val) {
+    if (!val_->has_value()) {
+      val_->emplace(std::forward<V>(val));
+    } else if constexpr (std::is_invocable_v<Func &, T &&, V &&>) {
+      **val_ = select_(std::move(**val_), std::forward<V>(val));
+    } else {
+      **val_ = select_(**val_, val);
+    }
+  }
+  void Post() {}
+  [[nodiscard]] bool Cancelled() const { return false; }
+
+ private:
+  Func select_;
+  std::optional<T> *val_;
+};
+
+template <typename T, typename Func>
+class FusedFindFirst {
+ public:
+  FusedFindFirst(Func func, std::optional<T> *val)
+      : func_(std::move(func)), val_(val) {}
+  void Pre(Extent) {}
+  template <typename V>
+  void Accept(V &&val) {
+    if (func_(val)) val_->emplace(std::forward<V>(val));
+  }
+  void Post() {}
+  [[nodiscard]] bool Cancelled() const { return val_->has_value(); }
+
+ private:
+  Func func_;
+  std::optional<T> *val_;
+};
+
+class FusedCount {
+ public:
+  explicit FusedCount(size_t *cnt) : cancelled_(false), cnt_(cnt) {}
+  void Pre(Extent ext) {
+    if (ext.sized) {
+      *cnt_ = ext.len;
+      cancelled_ = true;
+    }
+  }
+  template <typename V>
+  void Accept(const V &) {
+    ++*cnt_;
+  }
+  void Post() {}
+  [[nodiscard]] bool Cancelled() const { return cancelled_; }
+
+ private:
+  bool cancelled_;
+  size_t *cnt_;
+};
+
+template <typename KeyFunc, typename Agg, typename Map>
+class FusedGroupBy {
+ public:
+  FusedGroupBy(Map *map, KeyFunc key, Agg agg)
+      : map_(map), key_(std::move(key)), agg_(std::move(agg)) {}
+  void Pre(Extent) {}
+  template <typename V>
+  void Accept(const V &val) {
+    auto key = key_(val);
+    auto [slot, inserted] = map_->FindOrInsert(key, [&] {
+      return typename Map::value_type(std::move(key), agg_.Init(val));
+    });
+    if (!inserted) agg_.Add(slot->second, val);
+  }
+  void Post() {}
+  [[nodiscard]] bool Cancelled() const { return false; }
+
+ private:
+  Map *map_;
+  KeyFunc key_;
+  Agg agg_;
+};
+
+template <typename Hash>
+class FusedCountDistinct {
+ public:
+  FusedCountDistinct(HyperLogLog *hll, Hash hash)
+      : hll_(hll), hash_(std::move(hash)) {}
+  void Pre(Extent) {}
+  template <typename V>
+  void Accept(const V &val) {
+    hll_->Add(hash_(val));
+  }
+  void Post() {}
+  [[nodiscard]] bool Cancelled() const { return false; }
+
+ private:
+  HyperLogLog *hll_;
+  Hash hash_;
+};
+
+struct FusedHead {
+  template <typename Next>
+  Next operator()(Next next) const {
+    return next;
+  }
+};
+
+// Same builder API as Stream, but every stage is a template parameter rather
+// than a virtual Sink. `Make` wraps the downstream stage into the chain built
+// so far, so each builder returns a new FusedStream type.
+template <typename R, typename T, typename Make = FusedHead>
+class FusedStream {
+ public:
+  template <typename, typename, typename>
+  friend class FusedStream;
+
+  explicit FusedStream(R &&range) : range_(std::move(range)), make_() {}
+  FusedStream(const FusedStream &) = delete;
+  FusedStream(FusedStream &&) = default;
+  FusedStream &operator=(const FusedStream &) = delete;
+  FusedStream &operator=(FusedStream &&) = default;
+
+  template <typename Func>
+  auto Map(Func func) {
+    using U = std::decay_t<std::invoke_result_t<Func, const T &>>;
+    return Then<U>([func = std::move(func)](auto next) mutable {
+      return FusedMap<Func, decltype(next)>(std::move(func), std::move(next));
+    });
+  }
+  template <typename Func>
+  auto FlatMap(Func func) {
+    using U = value_type_of<std::invoke_result_t<Func, const T &>>;
+    return Then<U>([func = std::move(func)](auto next) mutable {
+      return FusedFlatMap<Func, decltype(next)>(std::move(func),
+                                                std::move(next));
+    });
+  }
+  template <typename Func>
+  auto Filter(Func func) {
+    static_assert(std::is_invocable_r_v<bool, Func, const T &>);
+    return Then<T>([func = std::move(func)](auto next) mutable {
+      return FusedFilter<Func, decltype(next)>(std::move(func),
+                                               std::move(next));
+    });
+  }
+  template <typename Func>
+  auto Peek(Func func) {
+    static_assert(std::is_invocable_v<Func, const T &>);
+    return Then<T>([func = std::move(func)](auto next) mutable {
+      return FusedPeek<Func, decltype(next)>(std::move(func), std::move(next));
+    });
+  }
+  template <typename Less = std::less<T>>
+  auto Sort(Less less = Less()) {
+    static_assert(std::is_invocable_r_v<bool, Less, const T &, const T &>);
+    return Then<T>([less = std::move(less)](auto next) mutable {
+      return FusedSort<T, Less, decltype(next)>(std::move(less),
+                                                std::move(next));
+    });
+  }
+  template <typename Less = std::less<T>>
+  auto TopK(size_t k, Less less = Less()) {
+    static_assert(std::is_invocable_r_v<bool, Less, const T &, const T &>);
+    return Then<T>([k, less = std::move(less)](auto next) mutable {
+      return FusedTopK<T, Less, decltype(next)>(k, std::move(less),
+                                                std::move(next));
+    });
+  }
+  auto Limit(size_t max) {
+    return Then<T>([max](auto next) {
+      return FusedLimit<decltype(next)>(max, std::move(next));
+    });
+  }
+  auto Skip(size_t skip) {
+    return Then<T>([skip](auto next) {
+      return FusedSkip<decltype(next)>(skip, std::move(next));
+    });
+  }
+  template <typename Hash = std::hash<T>>
+  auto Distinct(Hash hash = Hash()) {
+    static_assert(std::is_invocable_r_v<size_t, Hash, const T &>);
+    return Then<T>([hash = std::move(hash)](auto next) mutable {
+      return FusedDistinct<T, Hash, decltype(next)>(std::move(hash),
+                                                    std::move(next));
+    });
+  }
+
+  std::vector<T> Collect() {
+    std::vector<T> vals;
+    Evaluate(FusedCollect<T>(&vals));
+    return vals;
+  }
+  template <typename Func>
+  void ForEach(Func func) {
+    static_assert(std::is_invocable_r_v<void, Func, const T &>);
+    Evaluate(FusedForEach<Func>(std::move(func)));
+  }
+  template <typename Func>
+  T Reduce(Func most) {
+    static_assert(std::is_invocable_r_v<T, Func, const T &, const T &>);
+    std::optional<T> val;
+    Evaluate(FusedReduce<T, Func>(std::move(most), &val));
+    return val.has_value() ? std::move(*val) : T();
+  }
+  template <typename Func>
+  std::optional<T> FindFirst(Func func) {
+    static_assert(std::is_invocable_r_v<bool, Func, const T &>);
+    std::optional<T> val;
+    Evaluate(FusedFindFirst<T, Func>(std::move(func), &val));
+    return val;
+  }
+  size_t Count() {
+    size_t cnt = 0;
+    Evaluate(FusedCount(&cnt));
+    return cnt;
+  }
+  template <typename Key, typename Agg,
+            typename K = std::decay_t<std::invoke_result_t<Key, const T &>>,
+            typename Hash = std::hash<K>>
+  auto GroupBy(Key key, Agg agg, Hash hash = Hash()) {
+    using A = std::decay_t<decltype(agg.Init(std::declval<const T &>()))>;
+    FlatHashMap<K, A, Hash> map(1, std::move(hash));
+    Evaluate(FusedGroupBy<Key, Agg, decltype(map)>(&map, std::move(key),
+                                                   std::move(agg)));
+    return map;
+  }
+  template <typename Key>
+  auto CountBy(Key key) {
+    return GroupBy(std::move(key), Counting());
+  }
+  template <typename Hash = std::hash<T>>
+  size_t CountDistinct(size_t precision = HyperLogLog::kDefaultPrecision,
+                       Hash hash = Hash()) {
+    HyperLogLog hll(precision);
+    Evaluate(FusedCountDistinct<Hash>(&hll, std::move(hash)));
+    return hll.Estimate();
+  }
+
+ private:
+  FusedStream(R &&range, Make make)
+      : range_(std::move(range)), make_(std::move(make)) {}
+
+  template <typename U, typename Wrap>
+  auto Then(Wrap wrap) {
+    auto make = [make = std::move(make_), wrap = std::move(wrap)](
+                    auto next) mutable { return make(wrap(std::move(next))); };
+    return FusedStream<R, U, decltype(make)>(std::move(range_),
+                                             std::move(make));
+  }
+  template <typename Final>
+  void Evaluate(Final final) {
+    auto sink = make_(std::move(final));
+    const auto &range = [this]() -> decltype(auto) {
+      if constexpr (std::is_pointer_v<R>) {
+        return *range_;
+      } else {
+        return (range_);
+      }
+    }();
+    sink.Pre(SourceExtent(range));
+    for (const auto &val : range) {
+      if (sink.Cancelled()) break;
+      sink.Accept(val);
+    }
+    sink.Post();
+  }
+
+  R range_;
+  Make make_;
+};
+
+template <typename R>
+FusedStream(R &&)
+    ->FusedStream<R, std::decay_t<decltype(
+                         *std::declval<std::remove_pointer_t<R>>().begin())>>;
+
+#endif  // TOYS_STREAM_FUSED_H_
@@ -0,0 +1,109 @@
+//
+// Copyright [2020] <inhzus>
+//
+#ifndef TOYS_STREAM_GENERATOR_H_
+#define TOYS_STREAM_GENERATOR_H_
+
+#if defined(__cpp_impl_coroutine)
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <iterator>
+#include <memory>
+#include <utility>
+
+// A coroutine that co_yields elements of T, read as a single-pass range. The
+// coroutine runs only while the range is being iterated, up to its next
+// co_yield, so elements are produced as a Stream consumes them.
+template <typename T>
+class Generator {
+ public:
+  static constexpr bool kSized = false;
+
+  struct promise_type;
+  using Handle = std::coroutine_handle<promise_type>;
+
+  struct promise_type {
+    Generator get_return_object() {
+      return Generator(Handle::from_promise(*this));
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    // the yielded value, even a temporary, lives until the coroutine resumes
+    std::suspend_always yield_value(const T &val) noexcept {
+      val_ = std::addressof(val);
+      return {};
+    }
+    void return_void() {}
+    void unhandled_exception() { error_ = std::current_exception(); }
+
+    const T *val_ = nullptr;
+    std::exception_ptr error_;
+  };
+
+  class Iterator {
+   public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const T *;
+    using reference = const T &;
+
+    Iterator() : handle_(nullptr) {}
+    explicit Iterator(Handle handle) : handle_(handle) {}
+
+    const T &operator*() const { return *handle_.promise().val_; }
+    const T *operator->() const { return handle_.promise().val_; }
+    Iterator &operator++() {
+      Resume(handle_);
+      return *this;
+    }
+    void operator++(int) { ++*this; }
+    bool operator==(const Iterator &it) const { return done() == it.done(); }
+    bool operator!=(const Iterator &it) const { return done() != it.done(); }
+
+   private:
+    [[nodiscard]] bool done() const { return !handle_ || handle_.done(); }
+
+    Handle handle_;
+  };
+
+  Generator(const Generator &) = delete;
+  Generator(Generator &&gen) noexcept
+      : handle_(std::exchange(gen.handle_, nullptr)) {}
+  Generator &operator=(const Generator &) = delete;
+  Generator &operator=(Generator &&gen) noexcept {
+    std::swap(handle_, gen.handle_);
+    return *this;
+  }
+  ~Generator() {
+    if (handle_) handle_.destroy();
+  }
+
+  // Runs the coroutine up to its first co_yield; call it once.
+  Iterator begin() const {
+    if (handle_ && !handle_.done() && handle_.promise().val_ == nullptr) {
+      Resume(handle_);
+    }
+    return Iterator(handle_);
+  }
+  Iterator end() const { return Iterator(); }
+  [[nodiscard]] size_t size() const { return 0; }
+
+ private:
+  explicit Generator(Handle handle) : handle_(handle) {}
+
+  static void Resume(Handle handle) {
+    handle.resume();
+    if (auto error = std::exchange(handle.promise().error_, nullptr)) {
+      std::rethrow_exception(error);
+    }
+  }
+
+  Handle handle_;
+};
+
+#endif  // __cpp_impl_coroutine
+
+#endif  // TOYS_STREAM_GENERATOR_H_
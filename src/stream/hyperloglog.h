@@ -0,0 +1,100 @@
+//
+// Copyright [2020] <inhzus>
+//
+#ifndef TOYS_STREAM_HYPERLOGLOG_H_
+#define TOYS_STREAM_HYPERLOGLOG_H_
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "./flat_hash.h"
+
+// Estimates the number of distinct hashes added in 2^precision bytes, with a
+// standard error of about 1.04 / sqrt(2^precision): 0.8% at the default 14.
+class HyperLogLog {
+ public:
+  static constexpr size_t kDefaultPrecision = 14;
+
+  explicit HyperLogLog(size_t precision = kDefaultPrecision)
+      : precision_(precision), registers_(size_t(1) << precision) {
+    assert(precision >= 4 && precision <= 18);
+  }
+
+  void Add(uint64_t hash) {
+    hash = MixHash(hash);
+    size_t idx = hash >> (64 - precision_);
+    // rank of the first set bit in the rest, with a guard bit so it is bounded
+    uint64_t rest = (hash << precision_) | (uint64_t(1) << (precision_ - 1));
+    auto rank = static_cast<uint8_t>(LeadingZeros(rest) + 1);
+    registers_[idx] = std::max(registers_[idx], rank);
+  }
+  // Both sketches must have the same precision.
+  void Merge(const HyperLogLog &other) {
+    for (size_t i = 0; i < registers_.size(); ++i) {
+      registers_[i] = std::max(registers_[i], other.registers_[i]);
+    }
+  }
+  // Ertl's improved estimator ("New cardinality estimation algorithms for
+  // HyperLogLog sketches", 2017), which needs no bias correction or switch to
+  // linear counting anywhere in the range.
+  [[nodiscard]] size_t Estimate() const {
+    size_t q = 64 - precision_;
+    std::vector<size_t> counts(q + 2);
+    for (auto reg : registers_) ++counts[reg];
+    auto m = static_cast<double>(registers_.size());
+    double z = m * Tau(1 - static_cast<double>(counts[q + 1]) / m);
+    for (size_t k = q; k >= 1; --k) {
+      z = 0.5 * (z + static_cast<double>(counts[k]));
+    }
+    z += m * Sigma(static_cast<double>(counts[0]) / m);
+    return static_cast<size_t>(std::llround(m * m / (2 * std::log(2.0) * z)));
+  }
+  [[nodiscard]] size_t precision() const { return precision_; }
+
+ private:
+  // the series sigma and tau of the paper, summed until they stop changing
+  static double Sigma(double x) {
+    if (x == 1) return HUGE_VAL;
+    double y = 1;
+    double z = x;
+    for (double prev = -1; z != prev;) {
+      prev = z;
+      x *= x;
+      z += x * y;
+      y += y;
+    }
+    return z;
+  }
+  static double Tau(double x) {
+    if (x == 0 || x == 1) return 0;
+    double y = 1;
+    double z = 1 - x;
+    for (double prev = -1; z != prev;) {
+      prev = z;
+      x = std::sqrt(x);
+      y *= 0.5;
+      z -= (1 - x) * (1 - x) * y;
+    }
+    return z / 3;
+  }
+  static int LeadingZeros(uint64_t bits) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_clzll(bits);
+#else
+    int n = 0;
+    for (uint64_t mask = uint64_t(1) << 63; (bits & mask) == 0; mask >>= 1) {
+      ++n;
+    }
+    return n;
+#endif
+  }
+
+  size_t precision_;
+  std::vector<uint8_t> registers_;
+};
+
+#endif  // TOYS_STREAM_HYPERLOGLOG_H_
@@ -0,0 +1,113 @@
+//
+// Copyright [2020] <inhzus>
+//
+#ifndef TOYS_STREAM_JOIN_H_
+#define TOYS_STREAM_JOIN_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include "./flat_hash.h"
+#include "./parallel.h"
+
+// The build side of a hash join: rows, and a FlatHashMap from each key to the
+// first and last of its rows. Rows sharing a key are chained in insertion
+// order through `next_`, so there is one entry per key and no allocation per
+// row.
+template <typename Row, typename K, typename Hash>
+class HashJoinTable {
+ public:
+  HashJoinTable(const Hash &hash, size_t threads)
+      : hash_(hash), heads_(threads > 1 ? kPartitions : 1, hash) {}
+
+  std::vector<Row> &rows() { return rows_; }
+  // Drops the rows and their index, keeping the memory of both.
+  void clear() {
+    rows_.clear();
+    heads_.clear();
+    next_.clear();
+  }
+
+  // Indexes rows() by key(row). Large tables are built one partition per
+  // task on up to `threads` threads, so `key` must be thread-safe then.
+  template <typename Key>
+  void Build(const Key &key, size_t threads) {
+    size_t len = rows_.size();
+    next_.assign(len, kEnd);
+    if (threads <= 1 || heads_.partitions() == 1 || len < kParallelBuildMin) {
+      for (size_t i = 0; i < len; ++i) {
+        auto k = key(rows_[i]);
+        Insert(MixHash(hash_(k)), k, i);
+      }
+      return;
+    }
+    // hash in parallel, bucket the rows by partition in order, then fill
+    // every partition on its own
+    size_t parts = heads_.partitions();
+    std::vector<uint64_t> hashes(len);
+    ParallelFor(parts, threads, [&](size_t, size_t chunk) {
+      for (size_t i = len * chunk / parts; i < len * (chunk + 1) / parts; ++i) {
+        hashes[i] = MixHash(hash_(key(rows_[i])));
+      }
+    });
+    std::vector<size_t> offsets(parts + 1);
+    for (auto hash : hashes) ++offsets[heads_.Partition(hash) + 1];
+    for (size_t part = 0; part < parts; ++part) {
+      offsets[part + 1] += offsets[part];
+    }
+    std::vector<size_t> order(len);
+    std::vector<size_t> cursors(offsets.begin(), offsets.end() - 1);
+    for (size_t i = 0; i < len; ++i) {
+      order[cursors[heads_.Partition(hashes[i])]++] = i;
+    }
+    ParallelFor(parts, threads, [&](size_t, size_t part) {
+      for (size_t j = offsets[part]; j < offsets[part + 1]; ++j) {
+        size_t i = order[j];
+        Insert(hashes[i], key(rows_[i]), i);
+      }
+    });
+  }
+  // Calls func(index) for every row of `key` in insertion order until it
+  // returns false. Returns whether `key` has rows.
+  template <typename Func>
+  bool ForEachMatch(const K &key, Func func) {
+    auto *entry = heads_.find(key);
+    if (entry == nullptr) return false;
+    size_t i = entry->second.first;
+    while (i != kEnd && func(i)) i = next_[i];
+    return true;
+  }
+
+ private:
+  static constexpr size_t kEnd = std::numeric_limits<size_t>::max();
+  static constexpr size_t kPartitions = 64;
+  // Below this many rows one thread builds the table.
+  static constexpr size_t kParallelBuildMin = 1 << 14;
+
+  struct Chain {
+    size_t first;
+    size_t last;
+  };
+
+  // Only touches the partition of `hash` and the rows in it.
+  void Insert(uint64_t hash, const K &key, size_t i) {
+    auto &table = heads_.partition(heads_.Partition(hash));
+    auto [entry, inserted] = table.FindOrInsertHashed(hash, key, [&] {
+      return std::pair<K, Chain>(key, Chain{i, i});
+    });
+    if (!inserted) {
+      next_[entry->second.last] = i;
+      entry->second.last = i;
+    }
+  }
+
+  Hash hash_;
+  std::vector<Row> rows_;
+  FlatHashMap<K, Chain, Hash> heads_;
+  std::vector<size_t> next_;
+};
+
+#endif  // TOYS_STREAM_JOIN_H_
@@ -3,8 +3,17 @@
 //
 
 #include <algorithm>
+#include <cstdio>
+#include <numeric>
 #include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
 
+#include "./arena.h"
+#include "./columnar.h"
+#include "./fused.h"
+#include "./mapped_file.h"
 #include "./stream.h"
 
 int main() {
@@ -93,6 +102,15 @@ int main() {
   Stream(StepRange(0, 6, 1)).Skip(3).Peek([&cnt](int) { ++cnt; }).Collect();
   printf("%zu\n---\n", cnt);  // 3
 
+  std::vector<int> block(5000);
+  size_t peeked = 0;
+  size_t applied = 0;
+  Stream(&block).Peek([&peeked](int) { ++peeked; }).Limit(3).Collect();
+  Stream(&block)
+      .Map([&applied](int) { return ++applied; })
+      .FindFirst([](size_t val) { return val == 3; });
+  printf("%zu %zu\n---\n", peeked, applied);  // 3 3
+
   Stream(StepRange(
              0, [](int) { return true; }, [](int *it) { *it = (*it + 1) % 3; }))
       .Limit(12)
@@ -106,5 +124,269 @@ int main() {
                   .Filter([](int val) { return val % 2; })
                   .Count();
   printf("%zu\n---\n", cnt1);  // 5
+
+  std::vector<int> nums(100000);
+  std::iota(nums.begin(), nums.end(), 0);
+  auto odds = Stream(&nums)
+                  .Parallel()
+                  .Filter([](int val) { return val % 2; })
+                  .Map([](int val) { return std::to_string(val); })
+                  .Collect();
+  printf("%zu %s %s\n---\n", odds.size(), odds.front().c_str(),
+         odds.back().c_str());  // 50000 1 99999
+  auto total = Stream(&nums)
+                   .Parallel(false, 4)
+                   .Map([](int val) { return static_cast<int64_t>(val); })
+                   .Reduce([](int64_t lhs, int64_t rhs) { return lhs + rhs; });
+  printf("%lld\n---\n", static_cast<long long>(total));  // 4999950000
+  auto first = Stream(&nums).Parallel().Skip(10).FindFirst(
+      [](int val) { return val % 7 == 0; });
+  printf("%d\n---\n", *first);  // 14
+
+  FusedStream(StepRange(0, 10, 1))
+      .Map([](int val) { return val * val; })
+      .Filter([](int val) { return val % 2 == 1; })
+      .Map([](int val) { return std::to_string(val); })
+      .ForEach([](const std::string &s) { printf("%s ", s.c_str()); });
+  printf("\n---\n");  // 1 9 25 49 81
+
+  StreamArena<> arena;
+  Stream(StepRange(3, 6, 1), &arena)
+      .FlatMap([&arena](int val) {
+        return Stream(StepRange(val, val + 3, 1), &arena)
+            .Map([](int val) { return std::to_string(val); });
+      })
+      .ForEach([](const std::string &s) { printf("%s ", s.c_str()); });
+  printf("\n---\n");  // 3 4 5 4 5 6 5 6 7
+  printf("%zu %zu\n---\n", arena.allocations(),
+         arena.heap_allocations());  // 24 0
+
+  for (const auto &s : Stream(&nums)
+                           .Filter([](int val) { return val % 3 == 0; })
+                           .Map([](int val) { return std::to_string(val); })
+                           .Limit(4)) {
+    printf("%s ", s.c_str());
+  }
+  printf("\n---\n");  // 0 3 6 9
+
+  Stream(&nums)
+      .Parallel()
+      .Map([](int val) { return val * 7919 % 100000; })
+      .Sort(std::greater<>())
+      .Limit(3)
+      .ForEach([](int val) { printf("%d ", val); });
+  printf("\n---\n");  // 99999 99998 99997
+  auto shortest = Stream(&nums)
+                      .Map([](int val) { return std::to_string(val); })
+                      .TopK(2, [](const std::string &lhs,
+                                  const std::string &rhs) {
+                        return lhs.size() < rhs.size() ||
+                               (lhs.size() == rhs.size() && lhs < rhs);
+                      })
+                      .Collect();
+  printf("%s %s\n---\n", shortest[0].c_str(), shortest[1].c_str());  // 0 1
+
+  Stream(&nums)
+      .Map([](int val) { return val * 7919 % 100000; })
+      .ExternalSort(1 << 12)
+      .Skip(99997)
+      .ForEach([](int val) { printf("%d ", val); });
+  printf("\n---\n");  // 99997 99998 99999
+  // every worker spills runs of its own, merged once they are joined
+  Stream(&nums)
+      .Parallel(false, 4)
+      .Map([](int val) { return val * 7919 % 100000; })
+      .ExternalSort(1 << 12)
+      .Skip(99997)
+      .ForEach([](int val) { printf("%d ", val); });
+  printf("\n---\n");  // 99997 99998 99999
+  auto by_len = Stream(&nums)
+                    .Parallel(true, 4)
+                    .Map([](int val) { return std::to_string(val); })
+                    .StableSort([](const std::string &lhs,
+                                   const std::string &rhs) {
+                      return lhs.size() < rhs.size();
+                    })
+                    .Collect();
+  printf("%s %s %s\n---\n", by_len[1].c_str(), by_len[10].c_str(),
+         by_len.back().c_str());  // 1 10 99999
+  Stream(&nums)
+      .Map([](int val) { return std::to_string(val); })
+      .SortBy([](const std::string &s) { return -std::stoll(s); })
+      .Skip(99997)
+      .ForEach([](const std::string &s) { printf("%s ", s.c_str()); });
+  printf("\n---\n");  // 2 1 0
+
+  auto square_mod = [](int val) { return val % 1000 * (val % 1000) % 1000; };
+  auto distinct = Stream(&nums).Map(square_mod).Distinct().Count();
+  auto approx = Stream(&nums).Map(square_mod).CountDistinct();
+  printf("%zu %zu\n---\n", distinct, approx);  // 159 159
+  // between 2.5 and 5 times the 2^14 registers, where raw estimates are biased
+  approx = Stream(&nums)
+               .Map([](int val) { return val % 41000; })
+               .CountDistinct();
+  printf("%d\n---\n", approx > 40590 && approx < 41410);  // 1
+
+  auto by_digits = Stream(&nums)
+                       .Parallel()
+                       .Map([](int val) { return std::to_string(val); })
+                       .CountBy([](const std::string &s) { return s.size(); });
+  for (size_t digits = 1; digits <= 5; ++digits) {
+    printf("%zu ", by_digits.find(digits)->second);
+  }
+  printf("\n---\n");  // 10 90 900 9000 90000
+  auto largest = Stream(&nums).GroupBy(
+      [](int val) { return val % 10; },
+      Reducing([](int lhs, int rhs) { return std::max(lhs, rhs); }));
+  printf("%d\n---\n", largest.find(3)->second);  // 99993
+
+  int mapped = 0;
+  auto sized = Stream(&nums)
+                   .Map([&mapped](int val) {
+                     ++mapped;
+                     return val + 1;
+                   })
+                   .Count();
+  auto sorted_distinct =
+      Stream(&nums).Map(square_mod).Sort().Distinct().Sort().Count();
+  printf("%zu %d %zu\n---\n", sized, mapped,
+         sorted_distinct);  // 100000 0 159
+
+  const char *log_path = "stream-lines.tmp";
+  std::FILE *log = std::fopen(log_path, "w");
+  for (auto num : nums) std::fprintf(log, "line %d\n", num);
+  std::fclose(log);
+  {
+    MappedFile file(log_path);
+    auto sevens = Stream(file.Lines())
+                      .Parallel()
+                      .Filter([](std::string_view line) {
+                        return line.back() == '7';
+                      })
+                      .Count();
+    auto last = Stream(file.Lines()).Skip(99999).FindFirst(
+        [](std::string_view) { return true; });
+    printf("%zu %s\n---\n", sevens,
+           std::string(*last).c_str());  // 10000 line 99999
+  }
+  std::remove(log_path);
+
+  PipelineProfile profile;
+  Stream(&nums)
+      .Profile(&profile)
+      .Filter([](int val) { return val % 3 == 0; })
+      .Map([](int val) { return std::to_string(val); })
+      .Limit(10)
+      .Collect();
+  for (const auto &stage : profile.stages()) {
+    printf("%s %zu ", stage.name.c_str(), stage.in);
+  }
+  printf("\n---\n");  // Filter 28 Map 10 Limit 10 Collect 10
+
+  using Name = std::pair<int, std::string>;
+  std::vector<Name> names{{3, "three"}, {5, "five"}, {5, "cinq"}};
+  auto named = Stream(StepRange(1, 7, 1))
+                   .LeftJoin(
+                       &names, [](int num) { return num; },
+                       [](const Name &name) { return name.first; },
+                       [](int num, const Name *name) {
+                         return name ? name->second : std::to_string(num);
+                       })
+                   .Collect();
+  for (const auto &name : named) printf("%s ", name.c_str());
+  printf("\n---\n");  // 1 2 three 4 five cinq 6
+
+  auto moving = Stream(StepRange(
+                           1, [](int) { return true; }, 1))
+                    .SlidingWindow(3, 1, Summing([](int num) { return num; }))
+                    .Limit(4)
+                    .Collect();
+  for (const auto &[first, sum] : moving) printf("%zu:%d ", first, sum);
+  std::vector<int> stamps{1, 4, 9, 12, 31, 33};
+  auto per_ten =
+      Stream(&stamps)
+          .TumblingWindowBy([](int ms) { return ms; }, 10, Counting())
+          .Collect();
+  for (const auto &[start, cnt] : per_ten) printf("%d:%zu ", start, cnt);
+  printf("\n---\n");  // 0:6 1:9 2:12 3:15 0:3 10:1 30:2
+
+  struct Trade {
+    int id;
+    char symbol[8];
+    int price;
+    int quantity;
+  };
+  std::vector<Trade> trades;
+  for (int id = 0; id < 100; ++id) {
+    trades.push_back({id, "TOY", 100 + id % 10, id % 4});
+  }
+  auto turnover = ColumnarStream(&trades, &Trade::price, &Trade::quantity)
+                      .Filter<1>([](int quantity) { return quantity > 1; })
+                      .Map<0, 1>([](int price, int quantity) {
+                        return price * quantity;
+                      })
+                      .Reduce<2>([](int lhs, int rhs) { return lhs + rhs; });
+  printf("%d\n---\n", turnover);  // 13075
+
+  std::vector<int> head{1, 2, 3};
+  std::vector<int> tail{4, 5};
+  auto evens = Stream(Concat(&head, &tail, StepRange(6, 9, 1)))
+                   .Filter([](int num) { return num % 2 == 0; })
+                   .Collect();
+  for (auto num : evens) printf("%d ", num);
+  std::vector<std::string> labels{"one", "two", "three", "four"};
+  Stream(Zip(&head, &labels)).ForEach([](const auto &pair) {
+    printf("%d:%s ", std::get<0>(pair), std::get<1>(pair).c_str());
+  });
+  printf("\n---\n");  // 2 4 6 8 1:one 2:two 3:three
+
+  auto smallest = Stream(&head).Distinct().Sort().Limit(2).Prepare();
+  for (const auto &batch : {std::vector<int>{5, 3, 5, 1}, std::vector<int>{},
+                            std::vector<int>{9, 9}}) {
+    for (auto num : smallest.Collect(batch)) printf("%d ", num);
+    printf("%zu ", smallest.Count(batch));
+  }
+  printf("\n---\n");  // 1 3 2 0 9 1
+
+  size_t parsed = 0;
+  auto cached = Stream(&labels)
+                    .Map([&parsed](const std::string &s) {
+                      ++parsed;
+                      return s.size();
+                    })
+                    .Sort()
+                    .Cache();
+  printf("%zu %zu %zu %zu\n---\n", cached.Replay().Count(),
+         cached.Replay().Distinct().Count(),
+         cached.Replay().Reduce([](size_t lhs, size_t rhs) {
+           return lhs + rhs;
+         }),
+         parsed);  // 4 3 15 4
+
+  auto scores = Stream(&labels)
+                    .Map([](const std::string &s) { return s.size(); })
+                    .Handoff()
+                    .Map([](size_t len) { return len * len; })
+                    .Collect();
+  for (auto score : scores) printf("%zu ", score);
+  printf("\n---\n");  // 9 9 25 16
+
+#if defined(__cpp_impl_coroutine)
+  auto collatz = [](int num) -> Generator<int> {
+    for (; num != 1; num = num % 2 == 0 ? num / 2 : 3 * num + 1) {
+      co_yield num;
+    }
+    co_yield 1;
+  };
+  printf("%zu ", Stream(collatz(27)).Count());
+  auto peaks = Stream(collatz(27))
+                   .Filter([](int num) { return num > 1000; })
+                   .Generate();
+  for (auto num : peaks) {
+    printf("%d ", num);
+    if (num > 2000) break;
+  }
+  printf("\n---\n");  // 112 1186 1780 1336 1132 1276 1438 2158
+#endif
   return 0;
 }
@@ -0,0 +1,188 @@
+//
+// Copyright [2020] <inhzus>
+//
+#ifndef TOYS_STREAM_MAPPED_FILE_H_
+#define TOYS_STREAM_MAPPED_FILE_H_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Newline-delimited lines of a byte range, without their '\n'. The range does
+// not know how many lines it holds; it splits into parts on line boundaries
+// for a parallel Stream instead.
+class LineRange {
+ public:
+  static constexpr bool kSized = false;
+
+  class Iterator {
+   public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = std::string_view;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const std::string_view *;
+    using reference = std::string_view;
+
+    Iterator() : pos_(nullptr), eol_(nullptr), last_(nullptr) {}
+    Iterator(const char *pos, const char *last)
+        : pos_(pos), eol_(FindEol(pos, last)), last_(last) {}
+
+    std::string_view operator*() const {
+      return std::string_view(pos_, eol_ - pos_);
+    }
+    Iterator &operator++() {
+      pos_ = eol_ == last_ ? last_ : eol_ + 1;
+      eol_ = FindEol(pos_, last_);
+      return *this;
+    }
+    Iterator operator++(int) {
+      Iterator tmp(*this);
+      ++*this;
+      return tmp;
+    }
+    bool operator==(const Iterator &it) const { return pos_ == it.pos_; }
+    bool operator!=(const Iterator &it) const { return pos_ != it.pos_; }
+
+   private:
+    static const char *FindEol(const char *pos, const char *last) {
+      if (pos == last) return last;
+      const void *eol = std::memchr(pos, '\n', last - pos);
+      return eol == nullptr ? last : static_cast<const char *>(eol);
+    }
+
+    const char *pos_;
+    const char *eol_;
+    const char *last_;
+  };
+
+  LineRange(const char *first, const char *last) : first_(first), last_(last) {}
+
+  [[nodiscard]] Iterator begin() const { return Iterator(first_, last_); }
+  [[nodiscard]] Iterator end() const { return Iterator(last_, last_); }
+  [[nodiscard]] size_t size() const { return 0; }
+
+  // Up to `n` non-empty parts of about the same number of bytes, each ending
+  // right after a '\n' or at the end of the range.
+  [[nodiscard]] std::vector<LineRange> Split(size_t n) const {
+    std::vector<LineRange> parts;
+    size_t len = last_ - first_;
+    const char *lo = first_;
+    for (size_t i = 1; i <= n && lo != last_; ++i) {
+      const char *cut = last_;
+      if (i < n) {
+        cut = first_ + len / n * i + len % n * i / n;
+        if (cut <= lo) continue;
+        // the line `cut` falls in stays in this part
+        const void *eol = std::memchr(cut - 1, '\n', last_ - cut + 1);
+        cut = eol == nullptr ? last_ : static_cast<const char *>(eol) + 1;
+      }
+      parts.emplace_back(lo, cut);
+      lo = cut;
+    }
+    return parts;
+  }
+
+ private:
+  const char *first_;
+  const char *last_;
+};
+
+// Fixed-size records of a trivially copyable T laid out back to back.
+template <typename T>
+class RecordRange {
+ public:
+  static_assert(std::is_trivially_copyable_v<T>);
+
+  RecordRange(const T *first, size_t len) : first_(first), len_(len) {}
+
+  [[nodiscard]] const T *begin() const { return first_; }
+  [[nodiscard]] const T *end() const { return first_ + len_; }
+  [[nodiscard]] const T *data() const { return first_; }
+  [[nodiscard]] size_t size() const { return len_; }
+
+ private:
+  const T *first_;
+  size_t len_;
+};
+
+// A read-only private mapping of a whole file, advised for sequential access.
+// Lines() and Records() view the mapping without copying it, so the file
+// must outlive streams over them.
+class MappedFile {
+ public:
+  explicit MappedFile(const std::string &path)
+      : data_(nullptr), size_(0), path_(path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) Fail();
+    struct stat st {};
+    if (::fstat(fd, &st) != 0) {
+      int err = errno;
+      ::close(fd);
+      Fail(err);
+    }
+    size_ = static_cast<size_t>(st.st_size);
+    if (size_ != 0) {
+      void *data = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      int err = errno;
+      ::close(fd);
+      if (data == MAP_FAILED) Fail(err);
+      data_ = static_cast<const char *>(data);
+      // only a hint, so a failure is not an error
+      ::madvise(data, size_, MADV_SEQUENTIAL);
+    } else {
+      ::close(fd);
+    }
+  }
+  MappedFile(const MappedFile &) = delete;
+  MappedFile(MappedFile &&file) noexcept
+      : data_(std::exchange(file.data_, nullptr)),
+        size_(std::exchange(file.size_, 0)),
+        path_(std::move(file.path_)) {}
+  MappedFile &operator=(const MappedFile &) = delete;
+  MappedFile &operator=(MappedFile &&file) noexcept {
+    std::swap(data_, file.data_);
+    std::swap(size_, file.size_);
+    std::swap(path_, file.path_);
+    return *this;
+  }
+  ~MappedFile() {
+    if (data_ != nullptr) ::munmap(const_cast<char *>(data_), size_);
+  }
+
+  [[nodiscard]] const char *data() const { return data_; }
+  [[nodiscard]] size_t size() const { return size_; }
+
+  [[nodiscard]] LineRange Lines() const {
+    return LineRange(data_, data_ + size_);
+  }
+  // Bytes after the last whole record are left out.
+  template <typename T>
+  [[nodiscard]] RecordRange<T> Records() const {
+    return RecordRange<T>(reinterpret_cast<const T *>(data_),
+                          size_ / sizeof(T));
+  }
+
+ private:
+  [[noreturn]] void Fail(int err = errno) const {
+    throw std::system_error(err, std::generic_category(), path_);
+  }
+
+  const char *data_;
+  size_t size_;
+  std::string path_;
+};
+
+#endif  // TOYS_STREAM_MAPPED_FILE_H_
@@ -0,0 +1,349 @@
+//
+// Copyright [2020] <inhzus>
+//
+#ifndef TOYS_STREAM_MULTI_RANGE_H_
+#define TOYS_STREAM_MULTI_RANGE_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "./characteristics.h"
+#include "./traits.h"
+
+// The elements of a range, or of the range a pointer points to, as taken by
+// Stream(); the range is only read.
+template <typename R>
+const std::remove_pointer_t<R> &RangeOf(const R &range) {
+  if constexpr (std::is_pointer_v<R>) {
+    return *range;
+  } else {
+    return range;
+  }
+}
+
+template <typename R>
+using range_iterator_t =
+    decltype(std::declval<const std::remove_pointer_t<R> &>().begin());
+
+// [first, last) of a range with random access iterators, as a part of a
+// Concat() or Zip() range split for a parallel Stream.
+template <typename It>
+class Slice {
+ public:
+  Slice(It first, It last) : first_(first), last_(last) {}
+
+  [[nodiscard]] It begin() const { return first_; }
+  [[nodiscard]] It end() const { return last_; }
+  [[nodiscard]] size_t size() const { return last_ - first_; }
+
+ private:
+  It first_;
+  It last_;
+};
+
+template <typename... Rs>
+inline constexpr bool all_random_access_v =
+    (is_random_access_v<range_iterator_t<Rs>> && ...);
+
+template <typename... Rs>
+inline constexpr bool all_forward_v =
+    (is_forward_v<range_iterator_t<Rs>> && ...);
+
+// The ranges Rs one after the other. Its size is the sum of theirs if they
+// are all sized; a parallel Stream splits it into equal parts if they all
+// have random access iterators.
+template <typename... Rs>
+class ConcatRange {
+ public:
+  static_assert(sizeof...(Rs) > 0);
+  static constexpr bool kSized =
+      (is_sized_v<std::remove_pointer_t<Rs>> && ...);
+
+  class Iterator {
+   public:
+    using iterator_category =
+        std::conditional_t<all_forward_v<Rs...>, std::forward_iterator_tag,
+                           std::input_iterator_tag>;
+    using value_type = value_type_of<std::remove_pointer_t<
+        std::tuple_element_t<0, std::tuple<Rs...>>>>;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const value_type *;
+    // a reference if all the ranges yield the same one, else a copy
+    using reference = std::conditional_t<
+        (std::is_same_v<
+             decltype(*std::declval<range_iterator_t<Rs>>()),
+             decltype(*std::declval<range_iterator_t<
+                          std::tuple_element_t<0, std::tuple<Rs...>>>>())> &&
+         ...),
+        decltype(*std::declval<range_iterator_t<
+                     std::tuple_element_t<0, std::tuple<Rs...>>>>()),
+        value_type>;
+
+    Iterator() : active_(kCount) {}
+    Iterator(std::tuple<range_iterator_t<Rs>...> cur,
+             std::tuple<range_iterator_t<Rs>...> end)
+        : cur_(std::move(cur)), end_(std::move(end)), active_(0) {
+      SkipEmpty();
+    }
+
+    reference operator*() { return Deref<0>(); }
+    Iterator &operator++() {
+      Advance<0>();
+      SkipEmpty();
+      return *this;
+    }
+    Iterator operator++(int) {
+      Iterator tmp(*this);
+      ++*this;
+      return tmp;
+    }
+    bool operator==(const Iterator &it) const {
+      return active_ == it.active_ && (active_ == kCount || Equal<0>(it));
+    }
+    bool operator!=(const Iterator &it) const { return !operator==(it); }
+
+   private:
+    static constexpr size_t kCount = sizeof...(Rs);
+
+    template <size_t I>
+    reference Deref() {
+      if constexpr (I + 1 < kCount) {
+        if (active_ != I) return Deref<I + 1>();
+      }
+      return *std::get<I>(cur_);
+    }
+    template <size_t I>
+    void Advance() {
+      if constexpr (I + 1 < kCount) {
+        if (active_ != I) return Advance<I + 1>();
+      }
+      ++std::get<I>(cur_);
+    }
+    template <size_t I>
+    bool Equal(const Iterator &it) const {
+      if constexpr (I + 1 < kCount) {
+        if (active_ != I) return Equal<I + 1>(it);
+      }
+      return std::get<I>(cur_) == std::get<I>(it.cur_);
+    }
+    template <size_t I = 0>
+    void SkipEmpty() {
+      if constexpr (I < kCount) {
+        if (active_ == I) {
+          if (std::get<I>(cur_) != std::get<I>(end_)) return;
+          ++active_;
+        }
+        SkipEmpty<I + 1>();
+      }
+    }
+
+    std::tuple<range_iterator_t<Rs>...> cur_;
+    std::tuple<range_iterator_t<Rs>...> end_;
+    size_t active_;
+  };
+
+  explicit ConcatRange(Rs... ranges) : ranges_(std::move(ranges)...) {
+    static_assert(
+        (std::is_same_v<typename Iterator::value_type,
+                        value_type_of<std::remove_pointer_t<Rs>>> &&
+         ...));
+  }
+
+  [[nodiscard]] Iterator begin() const {
+    return Iterator(Iterators([](const auto &range) { return range.begin(); }),
+                    Iterators([](const auto &range) { return range.end(); }));
+  }
+  [[nodiscard]] Iterator end() const { return Iterator(); }
+  [[nodiscard]] size_t size() const {
+    if constexpr (kSized) {
+      return std::apply(
+          [](const auto &... ranges) {
+            return (size_t(0) + ... + RangeOf(ranges).size());
+          },
+          ranges_);
+    } else {
+      return 0;
+    }
+  }
+
+  // Up to `n` parts of about the same length, each a ConcatRange of the
+  // Slices of the ranges it overlaps.
+  template <bool B = kSized && all_random_access_v<Rs...>,
+            std::enable_if_t<B, int> = 0>
+  [[nodiscard]] auto Split(size_t n) const {
+    using Part = ConcatRange<Slice<range_iterator_t<Rs>>...>;
+    std::vector<Part> parts;
+    size_t len = size();
+    n = std::min(n, len);
+    for (size_t i = 0; i < n; ++i) {
+      parts.push_back(Cut(len * i / n, len * (i + 1) / n,
+                          std::index_sequence_for<Rs...>()));
+    }
+    return parts;
+  }
+
+ private:
+  template <typename Func>
+  std::tuple<range_iterator_t<Rs>...> Iterators(Func func) const {
+    return std::apply(
+        [&func](const auto &... ranges) {
+          return std::tuple<range_iterator_t<Rs>...>(func(RangeOf(ranges))...);
+        },
+        ranges_);
+  }
+  // The elements [lo, hi) of the concatenation.
+  template <size_t... Is>
+  auto Cut(size_t lo, size_t hi, std::index_sequence<Is...>) const {
+    size_t offsets[] = {RangeOf(std::get<Is>(ranges_)).size()...};
+    size_t first = 0;
+    for (auto &offset : offsets) {
+      size_t len = offset;
+      offset = first;
+      first += len;
+    }
+    auto slice = [lo, hi](const auto &range, size_t offset) {
+      auto first = range.begin();
+      size_t len = range.size();
+      size_t from = std::clamp(lo, offset, offset + len) - offset;
+      size_t to = std::clamp(hi, offset, offset + len) - offset;
+      return Slice<decltype(first)>(first + from, first + to);
+    };
+    return ConcatRange<Slice<range_iterator_t<Rs>>...>(
+        slice(RangeOf(std::get<Is>(ranges_)), offsets[Is])...);
+  }
+
+  std::tuple<Rs...> ranges_;
+};
+
+// Tuples of the elements at the same position of the ranges Rs, as long as
+// the shortest of them. Its size is that of the shortest if they are all
+// sized; a parallel Stream splits it into equal parts if they all have random
+// access iterators.
+template <typename... Rs>
+class ZipRange {
+ public:
+  static_assert(sizeof...(Rs) > 0);
+  static constexpr bool kSized =
+      (is_sized_v<std::remove_pointer_t<Rs>> && ...);
+
+  class Iterator {
+   public:
+    using iterator_category =
+        std::conditional_t<all_forward_v<Rs...>, std::forward_iterator_tag,
+                           std::input_iterator_tag>;
+    using value_type = std::tuple<value_type_of<std::remove_pointer_t<Rs>>...>;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const value_type *;
+    using reference = value_type;
+
+    Iterator(std::tuple<range_iterator_t<Rs>...> cur,
+             std::tuple<range_iterator_t<Rs>...> end)
+        : cur_(std::move(cur)), end_(std::move(end)) {}
+
+    value_type operator*() {
+      return std::apply([](auto &... its) { return value_type(*its...); },
+                        cur_);
+    }
+    Iterator &operator++() {
+      std::apply([](auto &... its) { (++its, ...); }, cur_);
+      return *this;
+    }
+    Iterator operator++(int) {
+      Iterator tmp(*this);
+      ++*this;
+      return tmp;
+    }
+    bool operator==(const Iterator &it) const {
+      bool done = Done();
+      return done == it.Done() && (done || cur_ == it.cur_);
+    }
+    bool operator!=(const Iterator &it) const { return !operator==(it); }
+
+   private:
+    [[nodiscard]] bool Done() const {
+      return Done(std::index_sequence_for<Rs...>());
+    }
+    template <size_t... Is>
+    [[nodiscard]] bool Done(std::index_sequence<Is...>) const {
+      return ((std::get<Is>(cur_) == std::get<Is>(end_)) || ...);
+    }
+
+    std::tuple<range_iterator_t<Rs>...> cur_;
+    std::tuple<range_iterator_t<Rs>...> end_;
+  };
+
+  explicit ZipRange(Rs... ranges) : ranges_(std::move(ranges)...) {}
+
+  [[nodiscard]] Iterator begin() const {
+    auto ends = Iterators([](const auto &range) { return range.end(); });
+    return Iterator(
+        Iterators([](const auto &range) { return range.begin(); }), ends);
+  }
+  [[nodiscard]] Iterator end() const {
+    auto ends = Iterators([](const auto &range) { return range.end(); });
+    return Iterator(ends, ends);
+  }
+  [[nodiscard]] size_t size() const {
+    if constexpr (kSized) {
+      return std::apply(
+          [](const auto &... ranges) {
+            return std::min({RangeOf(ranges).size()...});
+          },
+          ranges_);
+    } else {
+      return 0;
+    }
+  }
+
+  // Up to `n` parts of about the same length, each a ZipRange of the same
+  // Slice of every range.
+  template <bool B = kSized && all_random_access_v<Rs...>,
+            std::enable_if_t<B, int> = 0>
+  [[nodiscard]] auto Split(size_t n) const {
+    using Part = ZipRange<Slice<range_iterator_t<Rs>>...>;
+    std::vector<Part> parts;
+    size_t len = size();
+    n = std::min(n, len);
+    for (size_t i = 0; i < n; ++i) {
+      size_t lo = len * i / n;
+      size_t hi = len * (i + 1) / n;
+      parts.push_back(std::apply(
+          [lo, hi](const auto &... ranges) {
+            return Part(Slice(RangeOf(ranges).begin() + lo,
+                              RangeOf(ranges).begin() + hi)...);
+          },
+          ranges_));
+    }
+    return parts;
+  }
+
+ private:
+  template <typename Func>
+  std::tuple<range_iterator_t<Rs>...> Iterators(Func func) const {
+    return std::apply(
+        [&func](const auto &... ranges) {
+          return std::tuple<range_iterator_t<Rs>...>(func(RangeOf(ranges))...);
+        },
+        ranges_);
+  }
+
+  std::tuple<Rs...> ranges_;
+};
+
+// Ranges, or pointers to ranges that outlive the result, read in sequence or
+// in lockstep without being copied, e.g. Stream(Concat(&lhs, &rhs)).
+template <typename... Rs>
+ConcatRange<Rs...> Concat(Rs... ranges) {
+  return ConcatRange<Rs...>(std::move(ranges)...);
+}
+template <typename... Rs>
+ZipRange<Rs...> Zip(Rs... ranges) {
+  return ZipRange<Rs...>(std::move(ranges)...);
+}
+
+#endif  // TOYS_STREAM_MULTI_RANGE_H_
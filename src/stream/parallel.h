@@ -0,0 +1,162 @@
+//
+// Copyright [2020] <inhzus>
+//
+#ifndef TOYS_STREAM_PARALLEL_H_
+#define TOYS_STREAM_PARALLEL_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+inline size_t HardwareThreads() {
+  return std::max<size_t>(1, std::thread::hardware_concurrency());
+}
+
+// Runs func(worker, task) for every task in [0, n) on up to `threads` workers,
+// the calling thread being worker 0. Each worker starts with a contiguous run
+// of tasks and takes them from the front; once its run is drained it steals
+// the back half of the largest run left.
+template <typename Func>
+void ParallelFor(size_t n, size_t threads, Func func) {
+  struct Run {
+    std::mutex mu;
+    size_t lo = 0;
+    size_t hi = 0;
+  };
+  threads = std::max<size_t>(1, std::min(threads, n));
+  std::vector<Run> runs(threads);
+  for (size_t i = 0; i < threads; ++i) {
+    runs[i].lo = n * i / threads;
+    runs[i].hi = n * (i + 1) / threads;
+  }
+  std::atomic<bool> failed(false);
+  std::exception_ptr error;
+  std::mutex error_mu;
+
+  auto next = [&runs, &failed](size_t worker, size_t *task) {
+    Run &own = runs[worker];
+    {
+      std::lock_guard<std::mutex> lock(own.mu);
+      if (own.lo < own.hi) {
+        *task = own.lo++;
+        return true;
+      }
+    }
+    while (!failed) {
+      Run *victim = nullptr;
+      size_t most = 0;
+      for (auto &run : runs) {
+        std::lock_guard<std::mutex> lock(run.mu);
+        if (run.hi - run.lo > most) {
+          most = run.hi - run.lo;
+          victim = &run;
+        }
+      }
+      if (victim == nullptr) return false;
+      std::scoped_lock lock(own.mu, victim->mu);
+      size_t left = victim->hi - victim->lo;
+      if (left == 0) continue;
+      own.lo = victim->hi - (left + 1) / 2;
+      own.hi = victim->hi;
+      victim->hi = own.lo;
+      *task = own.lo++;
+      return true;
+    }
+    return false;
+  };
+  auto work = [&](size_t worker) {
+    try {
+      size_t task;
+      while (!failed && next(worker, &task)) func(worker, task);
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(error_mu);
+      if (!error) error = std::current_exception();
+      failed = true;
+    }
+  };
+
+  std::vector<std::thread> workers;
+  workers.reserve(threads - 1);
+  for (size_t i = 1; i < threads; ++i) workers.emplace_back(work, i);
+  work(0);
+  for (auto &worker : workers) worker.join();
+  if (error) std::rethrow_exception(error);
+}
+
+// Waits for another thread by spinning a little, then yielding, so a waiting
+// thread does not hold up the one it waits for on a busy core.
+class Backoff {
+ public:
+  void Wait() {
+    if (++spins_ < kSpins) return;
+    std::this_thread::yield();
+  }
+  void Reset() { spins_ = 0; }
+
+ private:
+  static constexpr size_t kSpins = 64;
+
+  size_t spins_ = 0;
+};
+
+// A bounded lock-free queue from one producer thread to one consumer thread.
+// Slots are filled and drained in place and reused, so slots holding buffers,
+// like vectors, keep their memory. Each side caches the other's index and
+// only reloads it when the ring looks full or empty.
+template <typename T>
+class SpscRing {
+ public:
+  // `capacity` is rounded up to a power of two.
+  explicit SpscRing(size_t capacity)
+      : head_(0), tail_cache_(0), tail_(0), head_cache_(0) {
+    size_t len = 1;
+    while (len < capacity) len *= 2;
+    slots_.resize(len);
+  }
+
+  // The slot to fill next, or nullptr while the ring is full.
+  T *Back() {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_cache_ == slots_.size()) {
+      tail_cache_ = tail_.load(std::memory_order_acquire);
+      if (head - tail_cache_ == slots_.size()) return nullptr;
+    }
+    return &slots_[head & (slots_.size() - 1)];
+  }
+  // Hands the slot from Back() over to the consumer.
+  void Push() {
+    head_.store(head_.load(std::memory_order_relaxed) + 1,
+                std::memory_order_release);
+  }
+  // The slot to drain next, or nullptr while the ring is empty.
+  T *Front() {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_cache_) {
+      head_cache_ = head_.load(std::memory_order_acquire);
+      if (tail == head_cache_) return nullptr;
+    }
+    return &slots_[tail & (slots_.size() - 1)];
+  }
+  // Gives the slot from Front() back to the producer.
+  void Pop() {
+    tail_.store(tail_.load(std::memory_order_relaxed) + 1,
+                std::memory_order_release);
+  }
+
+ private:
+  static constexpr size_t kCacheLine = 64;
+
+  // written by the producer
+  alignas(kCacheLine) std::atomic<size_t> head_;
+  size_t tail_cache_;
+  // written by the consumer
+  alignas(kCacheLine) std::atomic<size_t> tail_;
+  size_t head_cache_;
+  alignas(kCacheLine) std::vector<T> slots_;
+};
+
+#endif  // TOYS_STREAM_PARALLEL_H_
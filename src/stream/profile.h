@@ -0,0 +1,189 @@
+//
+// Copyright [2020] <inhzus>
+//
+#ifndef TOYS_STREAM_PROFILE_H_
+#define TOYS_STREAM_PROFILE_H_
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "./sink.h"
+
+// Heap allocations made by the calling thread. They are only counted in
+// programs where exactly one translation unit defines
+// STREAM_COUNT_ALLOCATIONS before including this header, which replaces the
+// global operator new; elsewhere this stays 0.
+inline size_t &ThreadAllocations() {
+  thread_local size_t allocations = 0;
+  return allocations;
+}
+
+#ifdef STREAM_COUNT_ALLOCATIONS
+#include <cstdlib>
+#include <new>
+
+// Not inlined, or GCC sees malloc() and free() paired with operator new and
+// delete and warns.
+#if defined(__GNUC__)
+#define STREAM_NOINLINE __attribute__((noinline))
+#else
+#define STREAM_NOINLINE
+#endif
+
+STREAM_NOINLINE void *operator new(std::size_t size) {
+  ++ThreadAllocations();
+  if (void *ptr = std::malloc(size == 0 ? 1 : size)) return ptr;
+  throw std::bad_alloc();
+}
+STREAM_NOINLINE void *operator new(std::size_t size, std::align_val_t align) {
+  ++ThreadAllocations();
+  // aligned_alloc takes sizes in multiples of the alignment only
+  auto alignment = static_cast<std::size_t>(align);
+  size_t blocks = std::max<std::size_t>(1, (size + alignment - 1) / alignment);
+  if (void *ptr = std::aligned_alloc(alignment, blocks * alignment)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+STREAM_NOINLINE void operator delete(void *ptr) noexcept { std::free(ptr); }
+STREAM_NOINLINE void operator delete(void *ptr, std::size_t) noexcept {
+  std::free(ptr);
+}
+STREAM_NOINLINE void operator delete(void *ptr, std::align_val_t) noexcept {
+  std::free(ptr);
+}
+STREAM_NOINLINE void operator delete(void *ptr, std::size_t,
+                                     std::align_val_t) noexcept {
+  std::free(ptr);
+}
+
+#undef STREAM_NOINLINE
+#endif  // STREAM_COUNT_ALLOCATIONS
+
+// What one stage did while a profiled Stream ran. Time and allocations
+// include the stages downstream of it, as elements are pushed through them
+// from inside the stage, and are summed over the threads of a parallel
+// stream.
+struct StageProfile {
+  explicit StageProfile(std::string name) : name(std::move(name)) {}
+
+  std::string name;
+  size_t in = 0;
+  std::chrono::nanoseconds time{0};
+  size_t allocations = 0;
+  bool cancelled = false;
+};
+
+// Filled in by a Stream given to Stream::Profile(), one StageProfile per stage
+// in pipeline order.
+class PipelineProfile {
+ public:
+  StageProfile *AddStage(const char *name) {
+    return &stages_.emplace_back(name);
+  }
+  void RemoveStage() { stages_.pop_back(); }
+  StageProfile &back() { return stages_.back(); }
+  void clear() { stages_.clear(); }
+  [[nodiscard]] const std::deque<StageProfile> &stages() const {
+    return stages_;
+  }
+
+  // One line per stage: elements in and out, and the time and allocations of
+  // the stage itself. A stage that stopped the source early is marked.
+  [[nodiscard]] std::string Explain() const {
+    std::string plan;
+    char line[128];
+    std::snprintf(line, sizeof(line), "%-16s %12s %12s %12s %10s\n", "stage",
+                  "in", "out", "time(ms)", "allocs");
+    plan += line;
+    for (size_t i = 0; i < stages_.size(); ++i) {
+      const auto &stage = stages_[i];
+      const StageProfile *next =
+          i + 1 < stages_.size() ? &stages_[i + 1] : nullptr;
+      auto time = stage.time;
+      size_t allocations = stage.allocations;
+      std::string out = "-";
+      if (next != nullptr) {
+        time -= next->time;
+        allocations -= next->allocations;
+        out = std::to_string(next->in);
+      }
+      std::snprintf(line, sizeof(line), "%-16s %12zu %12s %12.3f %10zu%s\n",
+                    stage.name.c_str(), stage.in, out.c_str(),
+                    std::chrono::duration<double, std::milli>(time).count(),
+                    allocations,
+                    stage.cancelled && (next == nullptr || !next->cancelled)
+                        ? "  cancelled"
+                        : "");
+      plan += line;
+    }
+    return plan;
+  }
+
+ private:
+  std::deque<StageProfile> stages_;
+};
+
+// Placed in front of a stage of a profiled Stream to count and time what goes
+// into it. Forks keep their own counts, added up when they are joined.
+template <typename T>
+class ProbeSink : public BasicSink<T> {
+ public:
+  explicit ProbeSink(StageProfile *stats)
+      : BasicSink<T>(), local_(std::string()), stats_(stats) {}
+
+  void Pre(Extent ext) final {
+    Measure([this, ext]() { this->next_->Pre(ext); });
+  }
+  void Accept(const T &val) final {
+    ++stats_->in;
+    Measure([this, &val]() { this->next_->Accept(val); });
+  }
+  void Accept(T &&val) final {
+    ++stats_->in;
+    Measure([this, &val]() { this->next_->Accept(std::move(val)); });
+  }
+  void AcceptBatch(const T *vals, size_t len) final {
+    stats_->in += len;
+    Measure([this, vals, len]() { this->next_->AcceptBatch(vals, len); });
+  }
+  void Post() final {
+    Measure([this]() { this->next_->Post(); });
+    stats_->cancelled = this->next_->Cancelled();
+  }
+  std::unique_ptr<Sink<T>> Fork() const final {
+    auto fork = std::make_unique<ProbeSink>(nullptr);
+    fork->stats_ = &fork->local_;
+    return fork;
+  }
+
+ protected:
+  void Merge(Sink<T> *fork) final {
+    const auto &local = static_cast<ProbeSink *>(fork)->local_;
+    stats_->in += local.in;
+    stats_->time += local.time;
+    stats_->allocations += local.allocations;
+    Measure([this, fork]() { Sink<T>::Merge(fork); });
+  }
+
+ private:
+  template <typename Func>
+  void Measure(Func func) {
+    size_t allocations = ThreadAllocations();
+    auto start = std::chrono::steady_clock::now();
+    func();
+    stats_->time += std::chrono::steady_clock::now() - start;
+    stats_->allocations += ThreadAllocations() - allocations;
+  }
+
+  StageProfile local_;
+  StageProfile *stats_;
+};
+
+#endif  // TOYS_STREAM_PROFILE_H_
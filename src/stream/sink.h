@@ -5,103 +5,379 @@
 #define TOYS_STREAM_SINK_H_
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cstddef>
+#include <exception>
 #include <functional>
-#include <unordered_set>
+#include <iterator>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <numeric>
+#include <optional>
+#include <thread>
 #include <utility>
 #include <vector>
 
+#include "./aggregate.h"
+#include "./characteristics.h"
+#include "./flat_hash.h"
+#include "./hyperloglog.h"
+#include "./join.h"
+#include "./parallel.h"
+#include "./sort.h"
+#include "./spill.h"
 #include "./traits.h"
+#include "./window.h"
 
-template <typename, typename>
-class Stream;
+template <typename T>
+class Sink;
+
+template <typename T>
+using SinkChain = std::pmr::vector<std::unique_ptr<Sink<T>>>;
+
+// Sources with contiguous storage are pushed in blocks of kBatchSize, and
+// stages over trivially copyable types transform a whole block in one loop.
+inline constexpr size_t kBatchSize = 1024;
+
+template <typename T>
+inline constexpr bool is_batchable_v =
+    std::is_trivially_copyable_v<T> &&std::is_default_constructible_v<T>;
 
 template <typename T>
 class Sink {
  public:
   Sink() : next_(nullptr) {}
   virtual ~Sink() = default;
-  virtual void Pre(size_t len) = 0;
+
+  // Stages may live in any memory resource, e.g. the arena of their Stream.
+  // The resource is kept in front of the object, so a std::unique_ptr can
+  // still delete it.
+  static void *operator new(size_t size, std::pmr::memory_resource *resource) {
+    size += sizeof(Header);
+    auto *header = static_cast<Header *>(
+        resource->allocate(size, alignof(std::max_align_t)));
+    *header = Header{resource, size};
+    return header + 1;
+  }
+  static void *operator new(size_t size) {
+    return operator new(size, std::pmr::new_delete_resource());
+  }
+  static void operator delete(void *ptr) {
+    auto *header = static_cast<Header *>(ptr) - 1;
+    header->resource->deallocate(header, header->size,
+                                 alignof(std::max_align_t));
+  }
+  static void operator delete(void *ptr, std::pmr::memory_resource *) {
+    operator delete(ptr);
+  }
+
+  virtual void Pre(Extent ext) = 0;
   virtual void Accept(const T &val) = 0;
+  virtual void Accept(T &&val) { Accept(static_cast<const T &>(val)); }
+  virtual void AcceptBatch(const T *vals, size_t len) {
+    for (size_t i = 0; i < len; ++i) {
+      if (Cancelled()) return;
+      Accept(vals[i]);
+    }
+  }
   virtual void Post() = 0;
   virtual void *Reciever() { return this; }
+  // A terminal that can keep a whole buffer handed to Evaluate(), as it is,
+  // takes it instead of its elements one by one.
+  virtual bool Adopt(std::vector<T> *) { return false; }
 
+  // Elements of an rvalue range are moved downstream.
   template <typename R>
-  void Evaluate(const R &range) {
-    auto *recv = static_cast<Sink<value_type_of<R>> *>(Reciever());
-    recv->Pre(range.size());
-    for (const auto &val : range) {
-      if (recv->Cancelled()) break;
-      recv->Accept(val);
+  void Evaluate(R &&range) {
+    using C = std::remove_reference_t<R>;
+    auto *recv = static_cast<Sink<value_type_of<C>> *>(Reciever());
+    if constexpr (!std::is_lvalue_reference_v<R> &&
+                  std::is_same_v<C, std::vector<value_type_of<C>>>) {
+      if (recv->Adopt(&range)) return;
+    }
+    recv->Pre(SourceExtent(range));
+    if constexpr (!std::is_lvalue_reference_v<R> &&
+                  !is_batchable_v<value_type_of<C>>) {
+      recv->Push(std::make_move_iterator(range.begin()),
+                 std::make_move_iterator(range.end()));
+    } else if constexpr (is_contiguous_v<C>) {
+      recv->PushBatch(std::data(range), range.size());
+    } else {
+      recv->Push(range.begin(), range.end());
     }
     recv->Post();
   }
+  template <typename It>
+  void Push(It first, It last) {
+    for (; first != last; ++first) {
+      if (Cancelled()) break;
+      Accept(*first);
+    }
+  }
+  // Blocks are cut to Demand(), so stages before one that may cancel never
+  // call their functions on elements past the point it cancels at.
+  void PushBatch(const T *vals, size_t len) {
+    while (len > 0 && !Cancelled()) {
+      size_t n = std::min({len, kBatchSize, std::max<size_t>(1, Demand())});
+      AcceptBatch(vals, n);
+      vals += n;
+      len -= n;
+    }
+  }
+
+  // A fork is an unlinked copy of the stage which runs over a disjoint chunk
+  // of the source on another thread. Stages that have to see the whole stream
+  // in order return nullptr, and the fork buffers their input instead.
+  virtual std::unique_ptr<Sink> Fork() const { return nullptr; }
+  // Folds `fork` and everything downstream of it back into this stage.
+  void Join(Sink *fork);
+  // Called on a fork after each chunk pushed into it, so a stage buffering
+  // elements may spill them before the fork sits idle until it is joined.
+  virtual void EndChunk() {}
+  // A stage that can absorb a Limit right after it returns its replacement.
+  virtual std::unique_ptr<Sink> FuseLimit(size_t, std::pmr::memory_resource *) {
+    return nullptr;
+  }
 
   [[nodiscard]] virtual bool Cancelled() const = 0;
+  // How many more elements this stage and those after it take before one of
+  // them may cancel, Extent::kUnbounded if none will.
+  [[nodiscard]] virtual size_t Demand() const { return Extent::kUnbounded; }
   void set_next(Sink *next) { next_ = next; }
 
  protected:
+  virtual void Merge(Sink *fork) {
+    if (next_ != nullptr) next_->Join(fork->next_);
+  }
+
   Sink<T> *next_;
+
+ private:
+  struct alignas(std::max_align_t) Header {
+    std::pmr::memory_resource *resource;
+    size_t size;
+  };
 };
 
+template <typename T>
+void LinkChain(SinkChain<T> *chain) {
+  for (size_t i = 0; i + 1 < chain->size(); ++i) {
+    (*chain)[i]->set_next((*chain)[i + 1].get());
+  }
+}
+
+template <typename S>
+std::unique_ptr<S> CopySink(const S &sink) {
+  if constexpr (std::is_copy_constructible_v<S>) {
+    return std::make_unique<S>(sink);
+  } else {
+    return nullptr;
+  }
+}
+
+// Stages passing on at most one element per element they take, like Map and
+// Filter, have the demand of the stage after them; a stage expanding elements
+// may be cancelled in the middle of any of them.
+inline size_t ExpandedDemand(size_t demand) {
+  return demand == Extent::kUnbounded ? demand : 1;
+}
+
 template <typename T>
 class BasicSink : public Sink<T> {
  public:
   [[nodiscard]] bool Cancelled() const override {
     return this->next_->Cancelled();
   }
+  [[nodiscard]] size_t Demand() const override {
+    return this->next_->Demand();
+  }
+  void EndChunk() override { this->next_->EndChunk(); }
 };
 
 template <typename T>
 class HeadSink : public BasicSink<T> {
  public:
-  void Pre(size_t len) final { this->next_->Pre(len); }
+  void Pre(Extent ext) final { this->next_->Pre(ext); }
+  void Accept(const T &val) final { this->next_->Accept(val); }
+  void Accept(T &&val) final { this->next_->Accept(std::move(val)); }
+  void AcceptBatch(const T *vals, size_t len) final {
+    this->next_->AcceptBatch(vals, len);
+  }
+  void Post() final { this->next_->Post(); }
+  std::unique_ptr<Sink<T>> Fork() const final { return CopySink(*this); }
+};
+
+// Last stage of a PreparedStream: passes elements on to the terminal of the
+// current run, which it does not own. A fork owns a fork of that terminal.
+template <typename T>
+class RelaySink : public BasicSink<T> {
+ public:
+  void Pre(Extent ext) final { this->next_->Pre(ext); }
   void Accept(const T &val) final { this->next_->Accept(val); }
+  void Accept(T &&val) final { this->next_->Accept(std::move(val)); }
+  void AcceptBatch(const T *vals, size_t len) final {
+    this->next_->AcceptBatch(vals, len);
+  }
   void Post() final { this->next_->Post(); }
+  std::unique_ptr<Sink<T>> Fork() const final {
+    auto terminal = this->next_->Fork();
+    if (terminal == nullptr) return nullptr;
+    auto fork = std::make_unique<RelaySink>();
+    fork->set_next(terminal.get());
+    fork->terminal_ = std::move(terminal);
+    return fork;
+  }
+
+ private:
+  std::unique_ptr<Sink<T>> terminal_;
 };
 
-template <typename R, typename T, typename U>
+template <typename T>
+class FinalSink : public Sink<T> {
+ public:
+  [[nodiscard]] bool Cancelled() const override { return false; }
+};
+
+template <typename T>
+class BufferSink : public FinalSink<T> {
+ public:
+  void Pre(Extent ext) final { vals_.reserve(ext.Reserve()); }
+  void Accept(const T &val) final { vals_.emplace_back(val); }
+  void Accept(T &&val) final { vals_.emplace_back(std::move(val)); }
+  void Post() final {}
+  std::vector<T> &vals() { return vals_; }
+
+ private:
+  std::vector<T> vals_;
+};
+
+template <typename T>
+void Sink<T>::Join(Sink *fork) {
+  if (auto *buf = dynamic_cast<BufferSink<T> *>(fork)) {
+    for (auto &val : buf->vals()) {
+      if (Cancelled()) break;
+      Accept(std::move(val));
+    }
+  } else {
+    Merge(fork);
+  }
+}
+
+// Forks every stage of `chain` into `forks`. A stage that cannot be forked is
+// replaced by a BufferSink, which ends the fork; returns false in that case.
+template <typename T>
+bool ForkChain(const SinkChain<T> &chain, SinkChain<T> *forks) {
+  bool complete = true;
+  for (const auto &sink : chain) {
+    auto fork = sink->Fork();
+    if (fork == nullptr) {
+      forks->emplace_back(std::make_unique<BufferSink<T>>());
+      complete = false;
+      break;
+    }
+    forks->emplace_back(std::move(fork));
+  }
+  LinkChain(forks);
+  return complete;
+}
+
+template <typename T, typename U>
+class ObjSink : public FinalSink<T> {
+ public:
+  explicit ObjSink(Sink<U> *cast) : FinalSink<T>(), cast_(cast) {}
+  [[nodiscard]] bool Cancelled() const final { return cast_->Cancelled(); }
+  [[nodiscard]] size_t Demand() const override { return cast_->Demand(); }
+  void EndChunk() final { cast_->EndChunk(); }
+  void set_cast(Sink<U> *cast) { cast_ = cast; }
+
+ protected:
+  void Merge(Sink<T> *fork) final {
+    cast_->Join(static_cast<ObjSink *>(fork)->cast_);
+  }
+
+  Sink<U> *cast_;
+};
+
+template <typename T, typename U>
 class CastSink : public BasicSink<U> {
  public:
-  explicit CastSink(Stream<R, T> &&stream) : stream_(std::move(stream)) {}
-  void Pre(size_t len) final { this->next_->Pre(len); };
+  explicit CastSink(SinkChain<T> &&sinks) : sinks_(std::move(sinks)) {}
+  void Pre(Extent ext) final { this->next_->Pre(ext); };
   void Accept(const U &val) final { this->next_->Accept(val); };
+  void Accept(U &&val) final { this->next_->Accept(std::move(val)); };
+  void AcceptBatch(const U *vals, size_t len) final {
+    this->next_->AcceptBatch(vals, len);
+  }
   void Post() final { this->next_->Post(); };
-  void *Reciever() final;
-  Stream<R, T> &stream() { return stream_; }
+  void *Reciever() final { return sinks_[0]->Reciever(); }
+  std::unique_ptr<Sink<U>> Fork() const final {
+    auto fork = std::make_unique<CastSink>(SinkChain<T>());
+    if (ForkChain(sinks_, &fork->sinks_)) {
+      static_cast<ObjSink<T, U> *>(fork->sinks_.back().get())
+          ->set_cast(fork.get());
+    }
+    return fork;
+  }
+  SinkChain<T> &sinks() { return sinks_; }
 
  private:
-  Stream<R, T> stream_;
+  SinkChain<T> sinks_;
 };
 
 template <typename T, typename Func>
 class MapSink : public BasicSink<T> {
  public:
   explicit MapSink(Func func) : BasicSink<T>(), func_(std::move(func)) {}
-  void Pre(size_t len) final { this->next_->Pre(len); }
+  void Pre(Extent ext) final { this->next_->Pre(ext); }
   void Accept(const T &val) final { this->next_->Accept(func_(val)); }
+  void Accept(T &&val) final {
+    this->next_->Accept(InvokeForwarded(func_, std::move(val)));
+  }
+  void AcceptBatch(const T *vals, size_t len) final {
+    if constexpr (is_batchable_v<T>) {
+      buf_.resize(len);
+      for (size_t i = 0; i < len; ++i) buf_[i] = func_(vals[i]);
+      this->next_->AcceptBatch(buf_.data(), len);
+    } else {
+      Sink<T>::AcceptBatch(vals, len);
+    }
+  }
   void Post() final { this->next_->Post(); }
+  std::unique_ptr<Sink<T>> Fork() const final { return CopySink(*this); }
 
  private:
   Func func_;
+  std::vector<T> buf_;
 };
 
 template <typename T, typename Func>
 class FlatMapSink : public BasicSink<T> {
  public:
   explicit FlatMapSink(Func func) : BasicSink<T>(), func_(std::move(func)) {}
-  void Pre(size_t len) final { this->next_->Pre(0); }
-  void Accept(const T &val) final {
-    auto container = func_(val);
-    for (const auto &item : container) {
+  void Pre(Extent) final { this->next_->Pre(Extent::Unknown()); }
+  void Accept(const T &val) final { Expand(func_(val)); }
+  void Accept(T &&val) final { Expand(InvokeForwarded(func_, std::move(val))); }
+  void Post() final { this->next_->Post(); }
+  [[nodiscard]] size_t Demand() const final {
+    return ExpandedDemand(this->next_->Demand());
+  }
+  std::unique_ptr<Sink<T>> Fork() const final { return CopySink(*this); }
+
+ private:
+  template <typename C>
+  void Expand(C &&container) {
+    for (auto &&item : container) {
       if (this->next_->Cancelled()) return;
-      this->next_->Accept(item);
+      if constexpr (std::is_reference_v<C>) {
+        this->next_->Accept(item);
+      } else {
+        this->next_->Accept(std::move(item));
+      }
     }
   }
-  void Post() final { this->next_->Post(); }
 
- private:
   Func func_;
 };
 
@@ -110,16 +386,38 @@ class FilterSink : public BasicSink<T> {
  public:
   explicit FilterSink(Func func) : BasicSink<T>(), func_(std::move(func)) {}
 
-  void Pre(size_t len) final { this->next_->Pre(0); }
+  void Pre(Extent ext) final { this->next_->Pre(ext.Bound()); }
   void Accept(const T &val) final {
     if (func_(val)) {
       this->next_->Accept(val);
     }
   }
+  void Accept(T &&val) final {
+    if (func_(val)) {
+      this->next_->Accept(std::move(val));
+    }
+  }
+  void AcceptBatch(const T *vals, size_t len) final {
+    if constexpr (is_batchable_v<T>) {
+      // branch-free compaction: every value is written, only selected ones
+      // advance the cursor
+      buf_.resize(len);
+      size_t n = 0;
+      for (size_t i = 0; i < len; ++i) {
+        buf_[n] = vals[i];
+        n += static_cast<bool>(func_(vals[i]));
+      }
+      if (n > 0) this->next_->AcceptBatch(buf_.data(), n);
+    } else {
+      Sink<T>::AcceptBatch(vals, len);
+    }
+  }
   void Post() final { this->next_->Post(); }
+  std::unique_ptr<Sink<T>> Fork() const final { return CopySink(*this); }
 
  private:
   Func func_;
+  std::vector<T> buf_;
 };
 
 template <typename T, typename Func>
@@ -127,51 +425,446 @@ class PeekSink : public BasicSink<T> {
  public:
   explicit PeekSink(Func func) : BasicSink<T>(), func_(std::move(func)) {}
 
-  void Pre(size_t len) final { this->next_->Pre(len); }
+  void Pre(Extent ext) final { this->next_->Pre(ext); }
   void Accept(const T &val) final {
     func_(val);
     this->next_->Accept(val);
   }
+  void Accept(T &&val) final {
+    func_(val);
+    this->next_->Accept(std::move(val));
+  }
+  void AcceptBatch(const T *vals, size_t len) final {
+    for (size_t i = 0; i < len; ++i) func_(vals[i]);
+    this->next_->AcceptBatch(vals, len);
+  }
   void Post() final { this->next_->Post(); }
+  std::unique_ptr<Sink<T>> Fork() const final { return CopySink(*this); }
 
  private:
   Func func_;
 };
 
-// stateful sinks
+// Passes elements on to the rest of the chain, which runs on a thread of its
+// own from Pre() to Post(), so the stages before and after it work at the same
+// time. Elements go over in batches of kBatchSize through an SpscRing of
+// `batches` slots. The producer learns that the rest of the chain is
+// cancelled, or has thrown, when the consumer is done with a batch; elements
+// it passes on after that are dropped.
+template <typename T>
+class HandoffSink : public BasicSink<T> {
+ public:
+  explicit HandoffSink(size_t batches)
+      : BasicSink<T>(),
+        ring_(std::make_unique<SpscRing<std::vector<T>>>(batches)),
+        batch_(nullptr),
+        done_(false),
+        cancelled_(false) {}
+  ~HandoffSink() override {
+    // a stage before it threw, so Post() never came
+    if (consumer_.joinable()) Finish();
+  }
+
+  void Pre(Extent ext) final {
+    this->next_->Pre(ext);
+    done_ = false;
+    cancelled_ = this->next_->Cancelled();
+    error_ = nullptr;
+    consumer_ = std::thread([this]() { Consume(); });
+  }
+  void Accept(const T &val) final { Put(val); }
+  void Accept(T &&val) final { Put(std::move(val)); }
+  void AcceptBatch(const T *vals, size_t len) final {
+    for (size_t i = 0; i < len; ++i) Put(vals[i]);
+  }
+  void Post() final {
+    Finish();
+    if (error_) std::rethrow_exception(error_);
+    this->next_->Post();
+  }
+  [[nodiscard]] bool Cancelled() const final {
+    return cancelled_.load(std::memory_order_relaxed);
+  }
+  // the stages after it run on their own thread
+  [[nodiscard]] size_t Demand() const final { return Extent::kUnbounded; }
+
+ private:
+  template <typename V>
+  void Put(V &&val) {
+    if (batch_ == nullptr) {
+      Backoff backoff;
+      while ((batch_ = ring_->Back()) == nullptr) {
+        if (Cancelled()) return;
+        backoff.Wait();
+      }
+      batch_->reserve(kBatchSize);
+    }
+    batch_->emplace_back(std::forward<V>(val));
+    if (batch_->size() == kBatchSize) {
+      ring_->Push();
+      batch_ = nullptr;
+    }
+  }
+  void Finish() {
+    if (batch_ != nullptr && !batch_->empty()) ring_->Push();
+    batch_ = nullptr;
+    done_.store(true, std::memory_order_release);
+    consumer_.join();
+  }
+  void Consume() {
+    Backoff backoff;
+    while (true) {
+      auto *batch = ring_->Front();
+      if (batch == nullptr) {
+        if (!done_.load(std::memory_order_acquire)) {
+          backoff.Wait();
+          continue;
+        }
+        // the last batches were pushed before done_ was set
+        batch = ring_->Front();
+        if (batch == nullptr) return;
+      }
+      backoff.Reset();
+      if (!Cancelled()) Drain(batch);
+      batch->clear();
+      ring_->Pop();
+    }
+  }
+  void Drain(std::vector<T> *batch) {
+    try {
+      if constexpr (is_batchable_v<T>) {
+        this->next_->PushBatch(batch->data(), batch->size());
+      } else {
+        this->next_->Push(std::make_move_iterator(batch->begin()),
+                          std::make_move_iterator(batch->end()));
+      }
+      cancelled_.store(this->next_->Cancelled(), std::memory_order_relaxed);
+    } catch (...) {
+      error_ = std::current_exception();
+      cancelled_.store(true, std::memory_order_relaxed);
+    }
+  }
+
+  std::unique_ptr<SpscRing<std::vector<T>>> ring_;
+  // the slot being filled
+  std::vector<T> *batch_;
+  std::atomic<bool> done_;
+  std::atomic<bool> cancelled_;
+  // thrown by the rest of the chain, read once the consumer has stopped
+  std::exception_ptr error_;
+  std::thread consumer_;
+};
+
+// stateful sinks, which start over in Pre() so a PreparedStream can run them
+// again; their buffers keep their capacity
+
+// Keeps the first k elements in `less` order in a max-heap: O(k) memory and
+// O(n log k) time, where Sort followed by Limit would buffer everything.
+template <typename T, typename Less>
+class TopKSink : public BasicSink<T> {
+ public:
+  TopKSink(size_t k, Less less)
+      : BasicSink<T>(), k_(k), less_(std::move(less)) {}
+
+  void Pre(Extent ext) final {
+    heap_.clear();
+    heap_.reserve(std::min(ext.Reserve(), k_));
+  }
+  void Accept(const T &val) final { Put(val); }
+  void Accept(T &&val) final { Put(std::move(val)); }
+  void AcceptBatch(const T *vals, size_t len) final {
+    for (size_t i = 0; i < len; ++i) Put(vals[i]);
+  }
+  void Post() final {
+    std::sort_heap(heap_.begin(), heap_.end(), less_);
+    this->next_->Evaluate(std::move(heap_));
+  }
+  [[nodiscard]] bool Cancelled() const final {
+    return k_ == 0 || this->next_->Cancelled();
+  }
+  [[nodiscard]] size_t Demand() const final { return Extent::kUnbounded; }
+  std::unique_ptr<Sink<T>> Fork() const final {
+    if constexpr (std::is_copy_constructible_v<Less>) {
+      return std::make_unique<TopKSink>(k_, less_);
+    } else {
+      return nullptr;
+    }
+  }
+  std::unique_ptr<Sink<T>> FuseLimit(
+      size_t max, std::pmr::memory_resource *resource) final {
+    return std::unique_ptr<Sink<T>>(
+        new (resource) TopKSink(std::min(k_, max), std::move(less_)));
+  }
+
+ protected:
+  // Nothing has reached the fork's downstream yet, so only the heaps merge.
+  void Merge(Sink<T> *fork) final {
+    for (auto &val : static_cast<TopKSink *>(fork)->heap_) Put(std::move(val));
+  }
+
+ private:
+  template <typename V>
+  void Put(V &&val) {
+    if (heap_.size() < k_) {
+      heap_.emplace_back(std::forward<V>(val));
+      std::push_heap(heap_.begin(), heap_.end(), less_);
+    } else if (k_ > 0 && less_(val, heap_.front())) {
+      std::pop_heap(heap_.begin(), heap_.end(), less_);
+      heap_.back() = std::forward<V>(val);
+      std::push_heap(heap_.begin(), heap_.end(), less_);
+    }
+  }
+
+  size_t k_;
+  Less less_;
+  std::vector<T> heap_;
+};
 
 template <typename T, typename Less>
 class SortSink : public BasicSink<T> {
  public:
-  explicit SortSink(Less less) : less_(std::move(less)), vals_() {}
+  explicit SortSink(Less less, bool stable = false, size_t threads = 1)
+      : less_(std::move(less)), stable_(stable), threads_(threads), vals_() {}
 
-  void Pre(size_t len) final { vals_.reserve(len); }
+  void Pre(Extent ext) final {
+    vals_.clear();
+    vals_.reserve(ext.Reserve());
+  }
   void Accept(const T &val) final { vals_.emplace_back(val); }
+  void Accept(T &&val) final { vals_.emplace_back(std::move(val)); }
+  void Post() final {
+    SortVector(&vals_, less_, threads_, stable_);
+    this->next_->Evaluate(std::move(vals_));
+  }
+  [[nodiscard]] size_t Demand() const final { return Extent::kUnbounded; }
+  std::unique_ptr<Sink<T>> FuseLimit(
+      size_t max, std::pmr::memory_resource *resource) final {
+    if (stable_) return nullptr;
+    return std::unique_ptr<Sink<T>>(
+        new (resource) TopKSink<T, Less>(max, std::move(less_)));
+  }
+
+ private:
+  Less less_;
+  bool stable_;
+  size_t threads_;
+  std::vector<T> vals_;
+};
+
+// Sorts at most `budget` bytes of elements at a time and spills each sorted
+// run to a temporary file; Post merges the runs while streaming them out.
+// Whenever kFanIn runs of the same level pile up they are merged into one run
+// of the next level, which bounds the number of open files.
+//
+// Forks spill runs of their own, which are merged with the others at the
+// join. The budget is shared: a fork spills once the stage and all its forks
+// buffer `budget` bytes together, and keeps at most half of it past the end of
+// a chunk.
+template <typename T, typename Less, typename Serializer>
+class ExternalSortSink : public BasicSink<T> {
+ public:
+  static constexpr size_t kFanIn = 16;
+
+  ExternalSortSink(size_t budget, Less less, Serializer serializer)
+      : BasicSink<T>(),
+        max_(std::max<size_t>(1, budget / sizeof(T))),
+        cnt_(0),
+        less_(std::move(less)),
+        serializer_(std::move(serializer)),
+        held_(std::make_shared<std::atomic<size_t>>(0)),
+        forked_(false) {}
+
+  void Pre(Extent ext) final {
+    cnt_ = 0;
+    held_->fetch_sub(vals_.size());
+    vals_.clear();
+    if (!forked_) vals_.reserve(std::min(ext.Reserve(), max_));
+  }
+  void Accept(const T &val) final { Put(val); }
+  void Accept(T &&val) final { Put(std::move(val)); }
   void Post() final {
+    held_->fetch_sub(vals_.size());
     std::sort(vals_.begin(), vals_.end(), less_);
-    this->next_->Evaluate(vals_);
+    if (runs_.empty()) {
+      this->next_->Evaluate(std::move(vals_));
+      return;
+    }
+    std::vector<T> out;
+    this->next_->Pre(Extent::Exactly(cnt_));
+    MergeRuns(0, true, [this, &out](T &&val) {
+      if constexpr (is_batchable_v<T>) {
+        out.push_back(val);
+        size_t demand = std::max<size_t>(1, this->next_->Demand());
+        if (out.size() < std::min(kBatchSize, demand)) {
+          return !this->next_->Cancelled();
+        }
+        this->next_->AcceptBatch(out.data(), out.size());
+        out.clear();
+      } else {
+        this->next_->Accept(std::move(val));
+      }
+      return !this->next_->Cancelled();
+    });
+    if (!out.empty() && !this->next_->Cancelled()) {
+      this->next_->AcceptBatch(out.data(), out.size());
+    }
+    this->next_->Post();
+    vals_.clear();
+    runs_.clear();
+    levels_.clear();
+  }
+  void EndChunk() final {
+    if (held_->load(std::memory_order_relaxed) > max_ / 2) Spill();
+  }
+  [[nodiscard]] size_t Demand() const final { return Extent::kUnbounded; }
+  std::unique_ptr<Sink<T>> Fork() const final {
+    if constexpr (std::is_copy_constructible_v<Less> &&
+                  std::is_copy_constructible_v<Serializer>) {
+      auto fork = std::make_unique<ExternalSortSink>(max_ * sizeof(T), less_,
+                                                     serializer_);
+      fork->held_ = held_;
+      fork->forked_ = true;
+      return fork;
+    } else {
+      return nullptr;
+    }
+  }
+  std::unique_ptr<Sink<T>> FuseLimit(
+      size_t max, std::pmr::memory_resource *resource) final {
+    return std::unique_ptr<Sink<T>>(
+        new (resource) TopKSink<T, Less>(max, std::move(less_)));
+  }
+
+ protected:
+  // Nothing has reached the fork's downstream yet; its runs join these.
+  void Merge(Sink<T> *fork) final {
+    auto *other = static_cast<ExternalSortSink *>(fork);
+    for (size_t i = 0; i < other->runs_.size(); ++i) {
+      runs_.push_back(std::move(other->runs_[i]));
+      levels_.push_back(other->levels_[i]);
+      Compact();
+    }
+    cnt_ += other->cnt_ - other->vals_.size();
+    held_->fetch_sub(other->vals_.size(), std::memory_order_relaxed);
+    for (auto &val : other->vals_) Put(std::move(val));
+    other->runs_.clear();
+    other->levels_.clear();
+    other->vals_.clear();
   }
 
  private:
+  template <typename V>
+  void Put(V &&val) {
+    vals_.emplace_back(std::forward<V>(val));
+    ++cnt_;
+    if (held_->fetch_add(1, std::memory_order_relaxed) + 1 < max_) return;
+    Spill();
+  }
+  void Spill() {
+    if (vals_.empty()) return;
+    std::sort(vals_.begin(), vals_.end(), less_);
+    runs_.emplace_back(serializer_);
+    runs_.back().Write(vals_.data(), vals_.size());
+    levels_.push_back(0);
+    held_->fetch_sub(vals_.size(), std::memory_order_relaxed);
+    // a fork gives its buffer back, the stage refills its own
+    if (forked_) {
+      std::vector<T>().swap(vals_);
+    } else {
+      vals_.clear();
+    }
+    Compact();
+  }
+  void Compact() {
+    size_t n = runs_.size();
+    while (n >= kFanIn && levels_[n - kFanIn] == levels_[n - 1]) {
+      SpillRun<T, Serializer> run(serializer_);
+      MergeRuns(n - kFanIn, false, [&run](T &&val) {
+        run.Write(&val, 1);
+        return true;
+      });
+      size_t level = levels_.back() + 1;
+      runs_.erase(runs_.end() - kFanIn, runs_.end());
+      levels_.erase(levels_.end() - kFanIn, levels_.end());
+      runs_.push_back(std::move(run));
+      levels_.push_back(level);
+      n = runs_.size();
+    }
+  }
+  // k-way merge of runs_[first..] and, if `tail`, of the sorted vals_, handing
+  // each element to out(T &&) for as long as it returns true.
+  template <typename Out>
+  void MergeRuns(size_t first, bool tail, Out out) {
+    size_t mem = runs_.size();
+    size_t pos = 0;
+    auto head = [&](size_t i) -> T & {
+      return i == mem ? vals_[pos] : runs_[i].head();
+    };
+    auto greater = [&](size_t lhs, size_t rhs) {
+      return less_(head(rhs), head(lhs));
+    };
+    std::vector<size_t> heap;
+    for (size_t i = first; i < mem; ++i) {
+      if (runs_[i].Rewind()) heap.push_back(i);
+    }
+    if (tail && !vals_.empty()) heap.push_back(mem);
+    std::make_heap(heap.begin(), heap.end(), greater);
+    while (!heap.empty()) {
+      std::pop_heap(heap.begin(), heap.end(), greater);
+      size_t i = heap.back();
+      if (!out(std::move(head(i)))) return;
+      if (i == mem ? ++pos < vals_.size() : runs_[i].Next()) {
+        std::push_heap(heap.begin(), heap.end(), greater);
+      } else {
+        heap.pop_back();
+      }
+    }
+  }
+
+  size_t max_;
+  size_t cnt_;
   Less less_;
+  Serializer serializer_;
   std::vector<T> vals_;
+  std::vector<SpillRun<T, Serializer>> runs_;
+  std::vector<size_t> levels_;
+  // elements buffered by the stage and its forks
+  std::shared_ptr<std::atomic<size_t>> held_;
+  bool forked_;
 };
 
 template <typename T>
 class LimitSink : public BasicSink<T> {
  public:
   explicit LimitSink(size_t max) : BasicSink<T>(), cnt_(0), max_(max) {}
-  void Pre(size_t len) final { this->next_->Pre(std::min(len, max_)); }
+  void Pre(Extent ext) final {
+    cnt_ = 0;
+    this->next_->Pre(ext.Limit(max_));
+  }
   void Accept(const T &val) final {
     if (cnt_ < max_) {
       ++cnt_;
       this->next_->Accept(val);
     }
   }
+  void Accept(T &&val) final {
+    if (cnt_ < max_) {
+      ++cnt_;
+      this->next_->Accept(std::move(val));
+    }
+  }
+  void AcceptBatch(const T *vals, size_t len) final {
+    len = std::min(len, max_ - cnt_);
+    cnt_ += len;
+    if (len > 0) this->next_->AcceptBatch(vals, len);
+  }
   void Post() final { this->next_->Post(); }
   [[nodiscard]] bool Cancelled() const final {
     return cnt_ >= max_ || this->next_->Cancelled();
   }
+  [[nodiscard]] size_t Demand() const final {
+    return std::min(max_ - std::min(cnt_, max_), this->next_->Demand());
+  }
 
  private:
   size_t cnt_;
@@ -182,9 +875,9 @@ template <typename T>
 class SkipSink : public BasicSink<T> {
  public:
   explicit SkipSink(size_t skip) : BasicSink<T>(), cnt_(0), skip_(skip) {}
-  void Pre(size_t len) final {
-    len = len > skip_ ? len - skip_ : 0;
-    this->next_->Pre(len);
+  void Pre(Extent ext) final {
+    cnt_ = 0;
+    this->next_->Pre(ext.Skip(skip_));
   }
   void Accept(const T &val) final {
     if (cnt_ < skip_) {
@@ -193,7 +886,25 @@ class SkipSink : public BasicSink<T> {
       this->next_->Accept(val);
     }
   }
+  void Accept(T &&val) final {
+    if (cnt_ < skip_) {
+      ++cnt_;
+    } else {
+      this->next_->Accept(std::move(val));
+    }
+  }
+  void AcceptBatch(const T *vals, size_t len) final {
+    size_t skipped = std::min(len, skip_ - cnt_);
+    cnt_ += skipped;
+    if (skipped < len) this->next_->AcceptBatch(vals + skipped, len - skipped);
+  }
   void Post() final { this->next_->Post(); }
+  [[nodiscard]] size_t Demand() const final {
+    size_t demand = this->next_->Demand();
+    size_t left = skip_ - std::min(cnt_, skip_);
+    return demand > Extent::kUnbounded - left ? Extent::kUnbounded
+                                               : demand + left;
+  }
 
  private:
   size_t cnt_;
@@ -203,23 +914,70 @@ class SkipSink : public BasicSink<T> {
 template <typename T, typename Hash>
 class DistinctSink : public BasicSink<T> {
  public:
-  explicit DistinctSink(Hash hash) : set_(0, std::move(hash)) {}
-  void Pre(size_t) final { this->next_->Pre(0); }
+  explicit DistinctSink(Hash hash) : set_(std::move(hash)) {}
+  void Pre(Extent ext) final {
+    set_.clear();
+    set_.reserve(std::min(ext.Reserve(), kMaxReserve));
+    this->next_->Pre(ext.Bound());
+  }
   void Accept(const T &val) final {
-    if (set_.insert(val).second) {
+    if (set_.insert(val)) {
       this->next_->Accept(val);
     }
   }
+  void Accept(T &&val) final {
+    if (set_.insert(val)) {
+      this->next_->Accept(std::move(val));
+    }
+  }
+  void AcceptBatch(const T *vals, size_t len) final {
+    if constexpr (is_batchable_v<T>) {
+      buf_.resize(len);
+      size_t n = 0;
+      for (size_t i = 0; i < len; ++i) {
+        buf_[n] = vals[i];
+        n += set_.insert(vals[i]);
+      }
+      if (n > 0) this->next_->AcceptBatch(buf_.data(), n);
+    } else {
+      Sink<T>::AcceptBatch(vals, len);
+    }
+  }
   void Post() final { this->next_->Post(); }
 
  private:
-  std::unordered_set<T, Hash> set_;
+  // the input may be mostly duplicates, so its length only hints the size
+  static constexpr size_t kMaxReserve = 1 << 16;
+
+  FlatHashSet<T, Hash> set_;
+  std::vector<T> buf_;
 };
 
+// Distinct() of a stream sorted in natural order, where duplicates are
+// adjacent: compares each element to the last one passed on.
 template <typename T>
-class FinalSink : public Sink<T> {
+class AdjacentDistinctSink : public BasicSink<T> {
  public:
-  [[nodiscard]] bool Cancelled() const override { return false; }
+  void Pre(Extent ext) final {
+    last_.reset();
+    this->next_->Pre(ext.Bound());
+  }
+  void Accept(const T &val) final {
+    if (!last_.has_value() || !(*last_ == val)) {
+      last_ = val;
+      this->next_->Accept(val);
+    }
+  }
+  void Accept(T &&val) final {
+    if (!last_.has_value() || !(*last_ == val)) {
+      last_ = val;
+      this->next_->Accept(std::move(val));
+    }
+  }
+  void Post() final { this->next_->Post(); }
+
+ private:
+  std::optional<T> last_;
 };
 
 template <typename T>
@@ -235,11 +993,30 @@ class BreakableSink : public FinalSink<T> {
 template <typename T>
 class CollectSink : public FinalSink<T> {
  public:
-  void Pre(size_t len) final { vals_.reserve(len); }
+  void Pre(Extent ext) final { vals_.reserve(ext.Reserve()); }
   void Accept(const T &val) final { vals_.emplace_back(val); }
+  void Accept(T &&val) final { vals_.emplace_back(std::move(val)); }
+  void AcceptBatch(const T *vals, size_t len) final {
+    vals_.insert(vals_.end(), vals, vals + len);
+  }
   void Post() final {}
+  bool Adopt(std::vector<T> *vals) final {
+    if (!vals_.empty()) return false;
+    vals_.swap(*vals);
+    return true;
+  }
+  std::unique_ptr<Sink<T>> Fork() const final {
+    return std::make_unique<CollectSink>();
+  }
   std::vector<T> &vals() { return vals_; }
 
+ protected:
+  void Merge(Sink<T> *fork) final {
+    auto &vals = static_cast<CollectSink *>(fork)->vals_;
+    vals_.insert(vals_.end(), std::make_move_iterator(vals.begin()),
+                 std::make_move_iterator(vals.end()));
+  }
+
  private:
   std::vector<T> vals_;
 };
@@ -247,12 +1024,18 @@ class CollectSink : public FinalSink<T> {
 template <typename T, typename Func>
 class ForEachSink : public FinalSink<T> {
  public:
-  explicit ForEachSink(Func func) : FinalSink<T>(), func_(std::move(func)) {}
-  void Pre(size_t len) final {}
+  explicit ForEachSink(Func func, bool concurrent = false)
+      : FinalSink<T>(), concurrent_(concurrent), func_(std::move(func)) {}
+  void Pre(Extent) final {}
   void Accept(const T &val) final { func_(val); }
+  void Accept(T &&val) final { InvokeForwarded(func_, std::move(val)); }
   void Post() final {}
+  std::unique_ptr<Sink<T>> Fork() const final {
+    return concurrent_ ? CopySink(*this) : nullptr;
+  }
 
  private:
+  bool concurrent_;
   Func func_;
 };
 
@@ -262,7 +1045,7 @@ class ReduceSink : public FinalSink<T> {
   explicit ReduceSink(Func most)
       : FinalSink<T>(), is_first_(true), select_(std::move(most)) {}
 
-  void Pre(size_t len) final {}
+  void Pre(Extent) final {}
   void Accept(const T &val) final {
     if (is_first_) {
       val_ = val;
@@ -272,50 +1055,403 @@ class ReduceSink : public FinalSink<T> {
       std::swap(val_, tmp);
     }
   }
+  void Accept(T &&val) final {
+    if (is_first_) {
+      val_ = std::move(val);
+      is_first_ = false;
+    } else if constexpr (std::is_invocable_v<Func &, T &&, T &&>) {
+      val_ = select_(std::move(val_), std::move(val));
+    } else {
+      decltype(auto) tmp = select_(val_, val);
+      std::swap(val_, tmp);
+    }
+  }
+  void AcceptBatch(const T *vals, size_t len) final {
+    if constexpr (is_batchable_v<T>) {
+      if (len == 0) return;
+      T acc = is_first_ ? vals[0] : select_(val_, vals[0]);
+      for (size_t i = 1; i < len; ++i) acc = select_(acc, vals[i]);
+      val_ = acc;
+      is_first_ = false;
+    } else {
+      Sink<T>::AcceptBatch(vals, len);
+    }
+  }
   void Post() final {}
+  std::unique_ptr<Sink<T>> Fork() const final {
+    if constexpr (std::is_copy_constructible_v<Func>) {
+      return std::make_unique<ReduceSink>(select_);
+    } else {
+      return nullptr;
+    }
+  }
 
   T &val() { return val_; }
 
+ protected:
+  void Merge(Sink<T> *fork) final {
+    auto *other = static_cast<ReduceSink *>(fork);
+    if (!other->is_first_) Accept(std::move(other->val_));
+  }
+
  private:
   bool is_first_;
   Func select_;
   T val_;
 };
 
-template <typename R, typename T, typename U, typename Func>
-class MapObjSink : public FinalSink<T> {
+template <typename T, typename U, typename Func>
+class MapObjSink : public ObjSink<T, U> {
  public:
-  MapObjSink(CastSink<R, T, U> *cast, Func func)
-      : FinalSink<T>(), cast_(cast), func_(std::move(func)) {}
-  void Pre(size_t len) final { cast_->Pre(len); }
-  void Accept(const T &val) final { cast_->Accept(func_(val)); }
-  void Post() final { cast_->Post(); }
-  [[nodiscard]] bool Cancelled() const final { return cast_->Cancelled(); }
+  MapObjSink(Sink<U> *cast, Func func)
+      : ObjSink<T, U>(cast), func_(std::move(func)) {}
+  void Pre(Extent ext) final { this->cast_->Pre(ext); }
+  void Accept(const T &val) final { this->cast_->Accept(func_(val)); }
+  void Accept(T &&val) final {
+    this->cast_->Accept(InvokeForwarded(func_, std::move(val)));
+  }
+  void AcceptBatch(const T *vals, size_t len) final {
+    if constexpr (is_batchable_v<U>) {
+      buf_.resize(len);
+      for (size_t i = 0; i < len; ++i) buf_[i] = func_(vals[i]);
+      this->cast_->AcceptBatch(buf_.data(), len);
+    } else {
+      Sink<T>::AcceptBatch(vals, len);
+    }
+  }
+  void Post() final { this->cast_->Post(); }
+  std::unique_ptr<Sink<T>> Fork() const final { return CopySink(*this); }
+
+ private:
+  Func func_;
+  std::vector<U> buf_;
+};
+
+template <typename T, typename U, typename Func>
+class FlatMapObjSink : public ObjSink<T, U> {
+ public:
+  FlatMapObjSink(Sink<U> *cast, Func func)
+      : ObjSink<T, U>(cast), func_(std::move(func)) {}
+  void Pre(Extent) final { this->cast_->Pre(Extent::Unknown()); }
+  void Accept(const T &val) final { Expand(func_(val)); }
+  void Accept(T &&val) final { Expand(InvokeForwarded(func_, std::move(val))); }
+  void Post() final { this->cast_->Post(); }
+  [[nodiscard]] size_t Demand() const final {
+    return ExpandedDemand(this->cast_->Demand());
+  }
+  std::unique_ptr<Sink<T>> Fork() const final { return CopySink(*this); }
 
  private:
-  CastSink<R, T, U> *cast_;
+  template <typename C>
+  void Expand(C &&vals) {
+    for (auto &&val : vals) {
+      if (this->cast_->Cancelled()) return;
+      if constexpr (std::is_reference_v<C>) {
+        this->cast_->Accept(val);
+      } else {
+        this->cast_->Accept(std::move(val));
+      }
+    }
+  }
+
   Func func_;
 };
 
-template <typename R, typename T, typename U, typename Func>
-class FlatMapObjSink : public FinalSink<T> {
+// Joins every element with the rows of `other`, a range or a pointer to one,
+// that have the same key: passes on combine(element, row), or in an outer
+// join combine(element, &row) and combine(element, nullptr) for elements
+// without rows. `other` is indexed by a HashJoinTable in Pre(), unless the
+// stream is sized and shorter: then the stream is buffered and indexed, and
+// `other` is probed against it in Post(). Once built, the index of `other` is
+// kept for later runs of a PreparedStream.
+template <typename T, typename V, typename Other, typename LKey, typename RKey,
+          typename Combine, typename Hash, bool Outer>
+class JoinObjSink : public ObjSink<T, V> {
  public:
-  FlatMapObjSink(CastSink<R, T, U> *cast, Func func)
-      : FinalSink<T>(), cast_(cast), func_(std::move(func)) {}
-  void Pre(size_t len) final { cast_->Pre(0); }
+  using Source = std::remove_pointer_t<Other>;
+  using U = value_type_of<Source>;
+  using K = std::decay_t<std::invoke_result_t<LKey &, const T &>>;
+  // rows of an lvalue range are not copied
+  using Row = std::conditional_t<
+      std::is_pointer_v<Other> && is_stable_range_v<Source>, const U *, U>;
+
+  JoinObjSink(Sink<V> *cast, Other other, LKey lkey, RKey rkey,
+              Combine combine, Hash hash, size_t threads)
+      : ObjSink<T, V>(cast),
+        lkey_(std::move(lkey)),
+        rkey_(std::move(rkey)),
+        combine_(std::move(combine)),
+        threads_(threads),
+        fork_(false),
+        state_(std::make_shared<State>(std::move(other), hash, threads)) {
+    static_assert(std::is_same_v<
+                  K, std::decay_t<std::invoke_result_t<RKey &, const U &>>>);
+  }
+  void Pre(Extent ext) final {
+    if (!fork_) Build(ext);
+    this->cast_->Pre(Extent::Unknown());
+  }
   void Accept(const T &val) final {
-    decltype(auto) vals = func_(val);
-    for (const auto &val : vals) {
-      if (cast_->Cancelled()) return;
-      cast_->Accept(val);
+    if (state_->build_left) {
+      state_->left.rows().emplace_back(val);
+    } else {
+      Probe(val);
     }
   }
-  void Post() final { cast_->Post(); }
-  [[nodiscard]] bool Cancelled() const final { return cast_->Cancelled(); }
+  void Accept(T &&val) final {
+    if (state_->build_left) {
+      state_->left.rows().emplace_back(std::move(val));
+    } else {
+      Probe(val);
+    }
+  }
+  void Post() final {
+    if (state_->build_left) ProbeLeft();
+    this->cast_->Post();
+  }
+  [[nodiscard]] size_t Demand() const final {
+    return ExpandedDemand(this->cast_->Demand());
+  }
+  // Forks share the index of `other`; a buffered stream is one barrier.
+  std::unique_ptr<Sink<T>> Fork() const final {
+    if (state_->build_left) return nullptr;
+    auto fork = CopySink(*this);
+    if (fork != nullptr) fork->fork_ = true;
+    return fork;
+  }
 
  private:
-  CastSink<R, T, U> *cast_;
-  Func func_;
+  struct State {
+    State(Other other, const Hash &hash, size_t threads)
+        : other(std::move(other)),
+          right(hash, threads),
+          left(hash, threads),
+          built(false),
+          build_left(false) {}
+
+    Other other;
+    HashJoinTable<Row, K, Hash> right;
+    HashJoinTable<T, K, Hash> left;
+    bool built;
+    bool build_left;
+  };
+
+  Source &other() {
+    if constexpr (std::is_pointer_v<Other>) {
+      return *state_->other;
+    } else {
+      return state_->other;
+    }
+  }
+  static const U &Get(const Row &row) {
+    if constexpr (std::is_pointer_v<Row>) {
+      return *row;
+    } else {
+      return row;
+    }
+  }
+  V Match(const T &val, const U &row) {
+    if constexpr (Outer) {
+      return combine_(val, &row);
+    } else {
+      return combine_(val, row);
+    }
+  }
+
+  void Build(Extent ext) {
+    auto &other = this->other();
+    if constexpr (is_sized_v<Source>) {
+      state_->build_left =
+          !state_->built && ext.sized && ext.len < other.size();
+    }
+    if (state_->build_left) {
+      state_->left.clear();
+      state_->left.rows().reserve(ext.len);
+      return;
+    }
+    if (state_->built) return;
+    state_->built = true;
+    auto &rows = state_->right.rows();
+    rows.reserve(SourceExtent(other).Reserve());
+    for (auto &&row : other) {
+      if constexpr (std::is_pointer_v<Row>) {
+        rows.push_back(&row);
+      } else {
+        rows.emplace_back(std::forward<decltype(row)>(row));
+      }
+    }
+    state_->right.Build([this](const Row &row) { return rkey_(Get(row)); },
+                        threads_);
+  }
+  void Probe(const T &val) {
+    auto &right = state_->right;
+    bool found = right.ForEachMatch(lkey_(val), [&](size_t i) {
+      this->cast_->Accept(Match(val, Get(right.rows()[i])));
+      return !this->cast_->Cancelled();
+    });
+    if constexpr (Outer) {
+      if (!found) this->cast_->Accept(combine_(val, nullptr));
+    }
+  }
+  void ProbeLeft() {
+    auto &left = state_->left;
+    auto &vals = left.rows();
+    left.Build(lkey_, threads_);
+    std::vector<bool> matched(Outer ? vals.size() : 0);
+    if (!vals.empty()) {
+      for (auto &&row : other()) {
+        if (this->cast_->Cancelled()) return;
+        left.ForEachMatch(rkey_(row), [&](size_t i) {
+          if constexpr (Outer) matched[i] = true;
+          this->cast_->Accept(Match(vals[i], row));
+          return !this->cast_->Cancelled();
+        });
+      }
+    }
+    if constexpr (Outer) {
+      for (size_t i = 0; i < vals.size(); ++i) {
+        if (this->cast_->Cancelled()) return;
+        if (!matched[i]) this->cast_->Accept(combine_(vals[i], nullptr));
+      }
+    }
+  }
+
+  LKey lkey_;
+  RKey rkey_;
+  Combine combine_;
+  size_t threads_;
+  bool fork_;
+  std::shared_ptr<State> state_;
+};
+
+// Windows of `width` keys starting every `slide` keys, passed on as (first key,
+// accumulator) pairs once the stream moves past them. The key of an element
+// is key(element), or its position in the stream if KeyFunc is void; keys
+// must not decrease, and a smaller key counts as the one before it. Windows
+// are cut into panes of gcd(width, slide) keys, each kept as one accumulator
+// in a PaneQueue, so memory grows with the window width, not the stream.
+// Count windows are passed on once full; the elements left at the end of the
+// stream come out as one last, shorter window if no earlier one held them.
+template <typename T, typename K, typename KeyFunc, typename Agg>
+class WindowSink
+    : public ObjSink<T, std::pair<K, std::decay_t<decltype(
+                                     std::declval<const Agg &>().Init(
+                                         std::declval<const T &>()))>>> {
+ public:
+  using A = std::decay_t<decltype(
+      std::declval<const Agg &>().Init(std::declval<const T &>()))>;
+  using V = std::pair<K, A>;
+  static constexpr bool kByCount = std::is_void_v<KeyFunc>;
+  using Key = std::conditional_t<kByCount, std::nullptr_t, KeyFunc>;
+
+  WindowSink(Sink<V> *cast, Key key, K width, K slide, Agg agg)
+      : ObjSink<T, V>(cast),
+        key_(std::move(key)),
+        agg_(std::move(agg)),
+        pane_(std::gcd(width, slide)),
+        width_(width / pane_),
+        slide_(slide / pane_),
+        seen_(0),
+        cur_(0),
+        next_(0),
+        end_(0) {
+    assert(width > 0 && slide > 0);
+  }
+  void Pre(Extent) final {
+    seen_ = 0;
+    acc_.reset();
+    panes_.clear();
+    next_ = 0;
+    end_ = 0;
+    this->cast_->Pre(Extent::Unknown());
+  }
+  void Accept(const T &val) final {
+    if constexpr (kByCount) {
+      Add(val, seen_ / pane_);
+      if (++seen_ % pane_ == 0) Flush(seen_ / pane_);
+    } else {
+      K pane = FloorDiv<K>(key_(val), pane_);
+      if (!acc_.has_value() && panes_.empty()) next_ = FirstStart(pane);
+      if (acc_.has_value() && pane > cur_) Flush(pane);
+      Add(val, pane);
+    }
+  }
+  void Post() final {
+    if constexpr (kByCount) {
+      if (acc_.has_value()) Flush(seen_ / pane_);
+      if (end_ * pane_ < seen_ && next_ * pane_ < seen_ &&
+          !this->cast_->Cancelled()) {
+        panes_.Evict(agg_, next_);
+        Emit();
+      }
+    } else {
+      if (acc_.has_value()) panes_.Push(agg_, cur_, std::move(*acc_));
+      acc_.reset();
+      while (!this->cast_->Cancelled()) {
+        panes_.Evict(agg_, next_);
+        if (panes_.empty()) break;
+        Emit();
+      }
+    }
+    this->cast_->Post();
+  }
+  [[nodiscard]] size_t Demand() const final {
+    return ExpandedDemand(this->cast_->Demand());
+  }
+
+ private:
+  void Add(const T &val, K pane) {
+    if (acc_.has_value()) {
+      agg_.Add(*acc_, val);
+    } else {
+      cur_ = pane;
+      acc_.emplace(agg_.Init(val));
+    }
+  }
+  // Queues the current pane and passes on the windows ending by `pane`.
+  void Flush(K pane) {
+    panes_.Push(agg_, cur_, std::move(*acc_));
+    acc_.reset();
+    while (next_ + width_ <= pane && !this->cast_->Cancelled()) {
+      panes_.Evict(agg_, next_);
+      if (panes_.empty()) {
+        // a gap in the keys: skip the windows with nothing in them
+        next_ = FirstStart(pane);
+        return;
+      }
+      Emit();
+    }
+  }
+  void Emit() {
+    this->cast_->Accept(V(next_ * pane_, panes_.Aggregate(agg_)));
+    end_ = next_ + width_;
+    next_ += slide_;
+  }
+  // The first window holding `pane`; windows of unsigned keys start at 0.
+  K FirstStart(K pane) const {
+    K start = FloorDiv(pane, slide_) * slide_;
+    K offset = pane - start;
+    if (width_ <= offset) return start + slide_;
+    K before = (width_ - offset - 1) / slide_ * slide_;
+    if constexpr (std::is_unsigned_v<K>) {
+      if (before > start) return 0;
+    }
+    return start - before;
+  }
+
+  Key key_;
+  Agg agg_;
+  // in keys, the rest in panes
+  K pane_;
+  K width_;
+  K slide_;
+  K seen_;
+  std::optional<A> acc_;
+  K cur_;
+  PaneQueue<K, A, Agg> panes_;
+  // start of the next window to pass on, and end of the last one
+  K next_;
+  K end_;
 };
 
 template <typename T, typename Func>
@@ -323,16 +1459,40 @@ class FindFirstSink : public BreakableSink<T> {
  public:
   explicit FindFirstSink(Func func)
       : BreakableSink<T>(), func_(std::move(func)) {}
-  void Pre(size_t len) final {}
+  void Pre(Extent) final {}
   void Accept(const T &val) final {
     if (func_(val)) {
       val_ = val;
       this->cancelled_ = true;
     }
   }
+  void Accept(T &&val) final {
+    if (func_(val)) {
+      val_ = std::move(val);
+      this->cancelled_ = true;
+    }
+  }
   void Post() {}
+  // any element may be the one
+  [[nodiscard]] size_t Demand() const final { return 1; }
+  std::unique_ptr<Sink<T>> Fork() const final {
+    if constexpr (std::is_copy_constructible_v<Func>) {
+      return std::make_unique<FindFirstSink>(func_);
+    } else {
+      return nullptr;
+    }
+  }
   T &val() { return val_; }
 
+ protected:
+  void Merge(Sink<T> *fork) final {
+    auto *other = static_cast<FindFirstSink *>(fork);
+    if (!this->cancelled_ && other->cancelled_) {
+      val_ = std::move(other->val_);
+      this->cancelled_ = true;
+    }
+  }
+
  private:
   Func func_;
   T val_;
@@ -342,18 +1502,174 @@ template <typename T>
 class CountSink : public BreakableSink<T> {
  public:
   CountSink() : BreakableSink<T>(), cnt_(0) {}
-  void Pre(size_t len) final {
-    if (len != 0) {
-      cnt_ = len;
+  void Pre(Extent ext) final {
+    if (ext.sized) {
+      cnt_ = ext.len;
       this->cancelled_ = true;
     }
   }
   void Accept(const T &) final { ++cnt_; }
+  void Accept(T &&) final { ++cnt_; }
+  void AcceptBatch(const T *, size_t len) final { cnt_ += len; }
   void Post() final {}
+  std::unique_ptr<Sink<T>> Fork() const final {
+    return std::make_unique<CountSink>();
+  }
   size_t cnt() { return cnt_; }
 
+ protected:
+  void Merge(Sink<T> *fork) final {
+    cnt_ += static_cast<CountSink *>(fork)->cnt_;
+  }
+
  private:
   size_t cnt_;
 };
 
+template <typename T, typename Hash>
+class CountDistinctSink : public FinalSink<T> {
+ public:
+  CountDistinctSink(size_t precision, Hash hash)
+      : FinalSink<T>(), hll_(precision), hash_(std::move(hash)) {}
+  void Pre(Extent) final {}
+  void Accept(const T &val) final { hll_.Add(hash_(val)); }
+  void Accept(T &&val) final { hll_.Add(hash_(val)); }
+  void AcceptBatch(const T *vals, size_t len) final {
+    for (size_t i = 0; i < len; ++i) hll_.Add(hash_(vals[i]));
+  }
+  void Post() final {}
+  std::unique_ptr<Sink<T>> Fork() const final {
+    if constexpr (std::is_copy_constructible_v<Hash>) {
+      return std::make_unique<CountDistinctSink>(hll_.precision(), hash_);
+    } else {
+      return nullptr;
+    }
+  }
+  [[nodiscard]] size_t cnt() const { return hll_.Estimate(); }
+
+ protected:
+  void Merge(Sink<T> *fork) final {
+    hll_.Merge(static_cast<CountDistinctSink *>(fork)->hll_);
+  }
+
+ private:
+  HyperLogLog hll_;
+  Hash hash_;
+};
+
+// Aggregates the elements of each key(element) with an aggregator from
+// aggregate.h. Forks fill tables of their own, which Post merges partition by
+// partition on up to `threads` threads.
+template <typename T, typename KeyFunc, typename Agg, typename Hash>
+class GroupBySink : public FinalSink<T> {
+ public:
+  using K = std::decay_t<std::invoke_result_t<KeyFunc &, const T &>>;
+  using A = std::decay_t<decltype(
+      std::declval<const Agg &>().Init(std::declval<const T &>()))>;
+  using Map = FlatHashMap<K, A, Hash>;
+
+  GroupBySink(KeyFunc key, Agg agg, Hash hash, size_t threads)
+      : FinalSink<T>(),
+        key_(std::move(key)),
+        agg_(std::move(agg)),
+        map_(threads > 1 ? kPartitions : 1, std::move(hash)),
+        threads_(threads) {}
+  void Pre(Extent) final {}
+  void Accept(const T &val) final { Add(val); }
+  void Accept(T &&val) final { Add(val); }
+  void Post() final {
+    size_t len = 0;
+    for (auto &partial : partials_) len += partial.size();
+    size_t threads = len >= kParallelMergeMin ? threads_ : 1;
+    ParallelFor(partials_.empty() ? 0 : map_.partitions(), threads,
+                [this](size_t, size_t part) {
+                  auto &table = map_.partition(part);
+                  for (auto &partial : partials_) {
+                    partial.partition(part).ForEach([&](auto &entry) {
+                      auto [slot, inserted] = table.FindOrInsert(
+                          entry.first, [&entry] { return std::move(entry); });
+                      if (!inserted) {
+                        agg_.Merge(slot->second, std::move(entry.second));
+                      }
+                    });
+                  }
+                });
+    partials_.clear();
+  }
+  std::unique_ptr<Sink<T>> Fork() const final {
+    if constexpr (std::is_copy_constructible_v<KeyFunc> &&
+                  std::is_copy_constructible_v<Agg>) {
+      return std::make_unique<GroupBySink>(key_, agg_, map_.hash_function(),
+                                           threads_);
+    } else {
+      return nullptr;
+    }
+  }
+  Map &map() { return map_; }
+
+ protected:
+  void Merge(Sink<T> *fork) final {
+    partials_.emplace_back(std::move(static_cast<GroupBySink *>(fork)->map_));
+  }
+
+ private:
+  static constexpr size_t kPartitions = 64;
+  // Below this many groups in the partial tables one thread merges them.
+  static constexpr size_t kParallelMergeMin = 1 << 14;
+
+  void Add(const T &val) {
+    auto key = key_(val);
+    auto [slot, inserted] = map_.FindOrInsert(key, [&] {
+      return std::pair<K, A>(std::move(key), agg_.Init(val));
+    });
+    if (!inserted) agg_.Add(slot->second, val);
+  }
+
+  KeyFunc key_;
+  Agg agg_;
+  Map map_;
+  std::vector<Map> partials_;
+  size_t threads_;
+};
+
+// Terminal of Stream::Iterator. One slot holds the element being pulled; only
+// stages emitting several elements per input, like FlatMap, or Sort releasing
+// its buffer, spill the rest into a vector.
+template <typename T>
+class PullSink : public FinalSink<T> {
+ public:
+  PullSink() : FinalSink<T>(), pos_(0) {}
+  void Pre(Extent) final {}
+  void Accept(const T &val) final { Put(val); }
+  void Accept(T &&val) final { Put(std::move(val)); }
+  void Post() final {}
+  [[nodiscard]] bool empty() const { return !slot_.has_value(); }
+  T &front() { return *slot_; }
+  void Pop() {
+    if (pos_ < spill_.size()) {
+      slot_ = std::move(spill_[pos_++]);
+      if (pos_ == spill_.size()) {
+        spill_.clear();
+        pos_ = 0;
+      }
+    } else {
+      slot_.reset();
+    }
+  }
+
+ private:
+  template <typename V>
+  void Put(V &&val) {
+    if (slot_.has_value()) {
+      spill_.emplace_back(std::forward<V>(val));
+    } else {
+      slot_.emplace(std::forward<V>(val));
+    }
+  }
+
+  std::optional<T> slot_;
+  std::vector<T> spill_;
+  size_t pos_;
+};
+
 #endif  // TOYS_STREAM_SINK_H_
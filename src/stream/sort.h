@@ -0,0 +1,260 @@
+//
+// Copyright [2020] <inhzus>
+//
+#ifndef TOYS_STREAM_SORT_H_
+#define TOYS_STREAM_SORT_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "./parallel.h"
+
+// Below this many elements threads cost more than they save.
+inline constexpr size_t kParallelSortMin = 1 << 16;
+// Below this many elements comparison sorting is faster.
+inline constexpr size_t kRadixSortMin = 1 << 10;
+
+// Number of elements of `a` among the first `d` elements of the stable merge
+// of a[0, m) and b[0, n).
+template <typename T, typename Less>
+size_t MergeRank(T *a, size_t m, T *b, size_t n, size_t d, Less &less) {
+  size_t lo = d > n ? d - n : 0;
+  size_t hi = std::min(d, m);
+  while (lo < hi) {
+    size_t i = lo + (hi - lo) / 2;
+    size_t j = d - i;
+    if (j == 0 || i == m || less(b[j - 1], a[i])) {
+      hi = i;
+    } else {
+      lo = i + 1;
+    }
+  }
+  return lo;
+}
+
+// Sorts `vals` on up to `threads` threads: one run per thread is sorted, then
+// runs are merged pairwise, each merge split evenly across the threads. Equal
+// elements keep their order if `stable`.
+template <typename T, typename Less>
+void ParallelSort(std::vector<T> *vals, Less &less, size_t threads,
+                  bool stable) {
+  size_t n = vals->size();
+  auto sort_run = [&less, stable](T *first, T *last) {
+    if (stable) {
+      std::stable_sort(first, last, less);
+    } else {
+      std::sort(first, last, less);
+    }
+  };
+  if constexpr (std::is_default_constructible_v<T>) {
+    if (threads > 1 && n >= kParallelSortMin) {
+      size_t runs = threads;
+      auto bound = [n, runs](size_t run) {
+        return n * std::min(run, runs) / runs;
+      };
+      ParallelFor(runs, threads, [&](size_t, size_t run) {
+        sort_run(vals->data() + bound(run), vals->data() + bound(run + 1));
+      });
+      std::vector<T> buf(n);
+      for (size_t width = 1; width < runs; width *= 2) {
+        size_t pairs = (runs + 2 * width - 1) / (2 * width);
+        size_t parts = std::max<size_t>(1, threads / pairs);
+        T *src = vals->data();
+        T *dst = buf.data();
+        // ranks[pair * (parts + 1) + part]: where the part's output starts and
+        // how much of it comes from the left run, found before any moves
+        std::vector<std::pair<size_t, size_t>> ranks(pairs * (parts + 1));
+        ParallelFor(ranks.size(), threads, [&](size_t, size_t task) {
+          size_t run = task / (parts + 1) * 2 * width;
+          size_t lo = bound(run);
+          size_t mid = bound(run + width);
+          size_t hi = bound(run + 2 * width);
+          size_t d = (hi - lo) * (task % (parts + 1)) / parts;
+          ranks[task] = {
+              d, MergeRank(src + lo, mid - lo, src + mid, hi - mid, d, less)};
+        });
+        ParallelFor(pairs * parts, threads, [&](size_t, size_t task) {
+          size_t run = task / parts * 2 * width;
+          size_t lo = bound(run);
+          size_t mid = bound(run + width);
+          auto [d0, i0] = ranks[task + task / parts];
+          auto [d1, i1] = ranks[task + task / parts + 1];
+          T *a = src + lo + i0;
+          T *a_end = src + lo + i1;
+          T *b = src + mid + d0 - i0;
+          T *b_end = src + mid + d1 - i1;
+          T *out = dst + lo + d0;
+          while (a != a_end && b != b_end) {
+            *out++ = less(*b, *a) ? std::move(*b++) : std::move(*a++);
+          }
+          std::move(b, b_end, std::move(a, a_end, out));
+        });
+        vals->swap(buf);
+      }
+      return;
+    }
+  }
+  sort_run(vals->data(), vals->data() + n);
+}
+
+// Orders elements by key(element) < key(element). Arithmetic keys are radix
+// sorted.
+template <typename Key>
+struct ByKey {
+  template <typename T>
+  bool operator()(const T &lhs, const T &rhs) const {
+    return key(lhs) < key(rhs);
+  }
+  Key key;
+};
+
+struct Identity {
+  template <typename T>
+  const T &operator()(const T &val) const {
+    return val;
+  }
+};
+
+// Keys whose order maps onto the order of their unsigned bits.
+template <typename K>
+inline constexpr bool is_radix_key_v =
+    (std::is_integral_v<K> && !std::is_same_v<K, bool>) ||
+    (std::is_floating_point_v<K> && std::numeric_limits<K>::is_iec559 &&
+     (sizeof(K) == 4 || sizeof(K) == 8));
+
+template <typename K>
+auto RadixBits(K key) {
+  if constexpr (std::is_integral_v<K>) {
+    using U = std::make_unsigned_t<K>;
+    auto bits = static_cast<U>(key);
+    if constexpr (std::is_signed_v<K>) {
+      bits ^= U(1) << (sizeof(U) * 8 - 1);
+    }
+    return bits;
+  } else {
+    using U = std::conditional_t<sizeof(K) == 4, uint32_t, uint64_t>;
+    if (key == 0) key = 0;  // -0.0 sorts along with 0.0
+    U bits;
+    std::memcpy(&bits, &key, sizeof(bits));
+    U sign = U(1) << (sizeof(U) * 8 - 1);
+    return (bits & sign) != 0 ? U(~bits) : U(bits | sign);
+  }
+}
+
+// The key a comparator orders by, for those that compare keys with `<`.
+template <typename T, typename Less>
+struct radix_key {};
+template <typename T>
+struct radix_key<T, std::less<T>> {
+  static Identity Get(const std::less<T> &) { return Identity(); }
+};
+template <typename T>
+struct radix_key<T, std::less<>> {
+  static Identity Get(const std::less<> &) { return Identity(); }
+};
+template <typename T, typename Key>
+struct radix_key<T, ByKey<Key>> {
+  static const Key &Get(const ByKey<Key> &less) { return less.key; }
+};
+
+template <typename T, typename Less>
+using radix_key_t = std::decay_t<decltype(radix_key<T, Less>::Get(
+    std::declval<const Less &>())(std::declval<const T &>()))>;
+
+template <typename T, typename Less, typename = void>
+struct is_radix_sortable : std::false_type {};
+template <typename T, typename Less>
+struct is_radix_sortable<T, Less, std::void_t<radix_key_t<T, Less>>>
+    : std::bool_constant<std::is_default_constructible_v<T> &&
+                         is_radix_key_v<radix_key_t<T, Less>>> {};
+template <typename T, typename Less>
+inline constexpr bool is_radix_sortable_v = is_radix_sortable<T, Less>::value;
+
+// Stable LSD radix sort on the bytes of key(element), skipping bytes every
+// element shares. With several threads each one counts and scatters its own
+// chunk.
+template <typename T, typename Key>
+void RadixSort(std::vector<T> *vals, const Key &key, size_t threads) {
+  using U = decltype(RadixBits(key(std::declval<const T &>())));
+  constexpr size_t kPasses = sizeof(U);
+  constexpr size_t kDigits = 256;
+  size_t n = vals->size();
+  size_t chunks = threads > 1 && n >= kParallelSortMin ? threads : 1;
+  auto bound = [n, chunks](size_t chunk) { return n * chunk / chunks; };
+  // hist[(chunk * kPasses + pass) * kDigits + digit]
+  std::vector<size_t> hist(chunks * kPasses * kDigits);
+  auto tally = [&](const T *src, size_t chunk, size_t pass, size_t passes) {
+    size_t *counts = &hist[(chunk * kPasses + pass) * kDigits];
+    std::fill(counts, counts + passes * kDigits, 0);
+    for (size_t i = bound(chunk); i < bound(chunk + 1); ++i) {
+      U bits = RadixBits(key(src[i])) >> (pass * 8);
+      for (size_t p = 0; p < passes; ++p, bits >>= 8) {
+        ++counts[p * kDigits + (bits & 0xff)];
+      }
+    }
+  };
+  ParallelFor(chunks, threads, [&](size_t, size_t chunk) {
+    tally(vals->data(), chunk, 0, kPasses);
+  });
+  std::vector<size_t> totals(kPasses * kDigits);
+  for (size_t chunk = 0; chunk < chunks; ++chunk) {
+    for (size_t i = 0; i < totals.size(); ++i) {
+      totals[i] += hist[chunk * kPasses * kDigits + i];
+    }
+  }
+
+  std::vector<T> buf(n);
+  std::vector<size_t> offsets(chunks * kDigits);
+  bool moved = false;
+  for (size_t pass = 0; pass < kPasses; ++pass) {
+    const size_t *total = &totals[pass * kDigits];
+    if (std::find(total, total + kDigits, n) != total + kDigits) continue;
+    T *src = vals->data();
+    T *dst = buf.data();
+    // chunks counted the digits of their original elements; recount for
+    // what they hold after the earlier passes
+    if (chunks > 1 && moved) {
+      ParallelFor(chunks, threads, [&](size_t, size_t chunk) {
+        tally(src, chunk, pass, 1);
+      });
+    }
+    size_t offset = 0;
+    for (size_t digit = 0; digit < kDigits; ++digit) {
+      for (size_t chunk = 0; chunk < chunks; ++chunk) {
+        offsets[chunk * kDigits + digit] = offset;
+        offset += hist[(chunk * kPasses + pass) * kDigits + digit];
+      }
+    }
+    ParallelFor(chunks, threads, [&](size_t, size_t chunk) {
+      size_t *offset = &offsets[chunk * kDigits];
+      for (size_t i = bound(chunk); i < bound(chunk + 1); ++i) {
+        size_t digit = RadixBits(key(src[i])) >> (pass * 8) & 0xff;
+        dst[offset[digit]++] = std::move(src[i]);
+      }
+    });
+    vals->swap(buf);
+    moved = true;
+  }
+}
+
+// Radix sorts when `less` compares arithmetic keys with `<`.
+template <typename T, typename Less>
+void SortVector(std::vector<T> *vals, Less &less, size_t threads,
+                bool stable) {
+  if constexpr (is_radix_sortable_v<T, Less>) {
+    if (vals->size() >= kRadixSortMin) {
+      RadixSort(vals, radix_key<T, Less>::Get(less), threads);
+      return;
+    }
+  }
+  ParallelSort(vals, less, threads, stable);
+}
+
+#endif  // TOYS_STREAM_SORT_H_
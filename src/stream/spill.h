@@ -0,0 +1,98 @@
+//
+// Copyright [2020] <inhzus>
+//
+#ifndef TOYS_STREAM_SPILL_H_
+#define TOYS_STREAM_SPILL_H_
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Writes elements as their raw bytes. Any type with the same Write and Read
+// members can be used to spill types that are not trivially copyable.
+template <typename T>
+struct RawSerializer {
+  static_assert(std::is_trivially_copyable_v<T>);
+  void Write(std::FILE *file, const T &val) const {
+    std::fwrite(&val, sizeof(T), 1, file);
+  }
+  bool Read(std::FILE *file, T *val) const {
+    return std::fread(val, sizeof(T), 1, file) == 1;
+  }
+};
+
+// A sorted run in a temporary file, removed when the run is destroyed. It is
+// written once and then read back in order, one head element at a time.
+template <typename T, typename Serializer>
+class SpillRun {
+ public:
+  static constexpr size_t kBufferSize = 1 << 16;
+  static constexpr size_t kReadBlock = kBufferSize / sizeof(T) + 1;
+
+  explicit SpillRun(Serializer serializer)
+      : serializer_(std::move(serializer)), file_(std::tmpfile()), pos_(0) {
+    if (file_ == nullptr) Fail();
+    std::setvbuf(file_, nullptr, _IOFBF, kBufferSize);
+  }
+  SpillRun(SpillRun &&run) noexcept
+      : serializer_(std::move(run.serializer_)),
+        file_(std::exchange(run.file_, nullptr)),
+        buf_(std::move(run.buf_)),
+        pos_(run.pos_) {}
+  SpillRun &operator=(SpillRun &&run) noexcept {
+    std::swap(serializer_, run.serializer_);
+    std::swap(file_, run.file_);
+    std::swap(buf_, run.buf_);
+    std::swap(pos_, run.pos_);
+    return *this;
+  }
+  ~SpillRun() {
+    if (file_ != nullptr) std::fclose(file_);
+  }
+
+  void Write(const T *vals, size_t len) {
+    if constexpr (std::is_same_v<Serializer, RawSerializer<T>>) {
+      std::fwrite(vals, sizeof(T), len, file_);
+    } else {
+      for (size_t i = 0; i < len; ++i) serializer_.Write(file_, vals[i]);
+    }
+  }
+  // Moves to the first element; false if the run is empty.
+  bool Rewind() {
+    if (std::fflush(file_) != 0 || std::ferror(file_)) Fail();
+    std::rewind(file_);
+    buf_.clear();
+    pos_ = 0;
+    return Load();
+  }
+  bool Next() { return ++pos_ < buf_.size() || Load(); }
+  T &head() { return buf_[pos_]; }
+
+ private:
+  bool Load() {
+    pos_ = 0;
+    if constexpr (std::is_same_v<Serializer, RawSerializer<T>>) {
+      buf_.resize(kReadBlock);
+      buf_.resize(std::fread(buf_.data(), sizeof(T), kReadBlock, file_));
+    } else {
+      buf_.resize(1);
+      if (!serializer_.Read(file_, &buf_[0])) buf_.clear();
+    }
+    if (std::ferror(file_)) Fail();
+    return !buf_.empty();
+  }
+  [[noreturn]] static void Fail() {
+    throw std::system_error(errno, std::generic_category(), "spill run");
+  }
+
+  Serializer serializer_;
+  std::FILE *file_;
+  std::vector<T> buf_;
+  size_t pos_;
+};
+
+#endif  // TOYS_STREAM_SPILL_H_
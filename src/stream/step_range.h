@@ -4,8 +4,13 @@
 #ifndef TOYS_STREAM_STEP_RANGE_H_
 #define TOYS_STREAM_STEP_RANGE_H_
 
+#include <cassert>
+#include <cmath>
 #include <cstddef>
+#include <cstdint>
 #include <functional>
+#include <iterator>
+#include <optional>
 #include <type_traits>
 #include <utility>
 #include <vector>
@@ -13,23 +18,14 @@
 template <typename T, typename ValidFunc, typename StepFunc>
 class StepRange {
  public:
+  // Ends where valid_func first fails, so its length is unknown.
+  static constexpr bool kSized = false;
+
   class Iterator {
    public:
-    Iterator() : range_(nullptr), cur_(nullptr) {}
+    Iterator() : range_(nullptr) {}
     explicit Iterator(const StepRange *range) : range_(range) {
-      cur_ = range_ == nullptr ? nullptr : new T(range_->start_);
-    }
-    Iterator(const Iterator &it) : range_(it.range_) {
-      cur_ = it.cur_ == nullptr ? nullptr : new T(it.cur_);
-    }
-    Iterator &operator=(const Iterator &it) {
-      range_ = it.range_;
-      if (cur_ != nullptr) delete cur_;
-      cur_ = it.cur_ == nullptr ? nullptr : new T(it.cur_);
-      return *this;
-    }
-    ~Iterator() {
-      if (cur_ != nullptr) delete cur_;
+      if (range_ != nullptr) cur_.emplace(range_->start_);
     }
 
     bool operator==(const Iterator &it) const {
@@ -41,20 +37,20 @@ class StepRange {
     }
     bool operator!=(const Iterator &it) const { return !operator==(it); }
     T &operator*() { return *cur_; }
-    T *operator->() { return cur_; }
+    T *operator->() { return &*cur_; }
     T &operator++() {
-      range_->step_func_(cur_);
+      range_->step_func_(&*cur_);
       return *cur_;
     }
     T operator++(int) {
       T tmp(*cur_);
-      range_->step_func_(cur_);
+      range_->step_func_(&*cur_);
       return tmp;
     }
 
    private:
     const StepRange *range_;
-    T *cur_;
+    std::optional<T> cur_;
   };
 
   template <typename Step>
@@ -90,13 +86,134 @@ class StepRange {
   StepFunc step_func_;
 };
 
-template <typename T, typename Step,
-          std::enable_if_t<std::is_same_v<T, decltype(std::declval<T>() +
-                                                      std::declval<Step>())>,
-                           int> = 0>
+// Arithmetic progression start, start + step, ... stopping before `stop`.
+// Elements are computed from their index, so the range knows its size and
+// its iterators are random access.
+template <typename T, typename Step>
+class StepRange<T, void, Step> {
+ public:
+  class Iterator {
+   public:
+    using iterator_category = std::random_access_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const T *;
+    using reference = T;
+
+    Iterator() : start_(), step_(), idx_(0) {}
+    Iterator(T start, Step step, difference_type idx)
+        : start_(start), step_(step), idx_(idx) {}
+
+    T operator*() const { return At(idx_); }
+    T operator[](difference_type n) const { return At(idx_ + n); }
+    Iterator &operator++() {
+      ++idx_;
+      return *this;
+    }
+    Iterator operator++(int) { return Iterator(start_, step_, idx_++); }
+    Iterator &operator--() {
+      --idx_;
+      return *this;
+    }
+    Iterator operator--(int) { return Iterator(start_, step_, idx_--); }
+    Iterator &operator+=(difference_type n) {
+      idx_ += n;
+      return *this;
+    }
+    Iterator &operator-=(difference_type n) {
+      idx_ -= n;
+      return *this;
+    }
+    Iterator operator+(difference_type n) const {
+      return Iterator(start_, step_, idx_ + n);
+    }
+    friend Iterator operator+(difference_type n, const Iterator &it) {
+      return it + n;
+    }
+    Iterator operator-(difference_type n) const {
+      return Iterator(start_, step_, idx_ - n);
+    }
+    difference_type operator-(const Iterator &it) const {
+      return idx_ - it.idx_;
+    }
+    bool operator==(const Iterator &it) const { return idx_ == it.idx_; }
+    bool operator!=(const Iterator &it) const { return idx_ != it.idx_; }
+    bool operator<(const Iterator &it) const { return idx_ < it.idx_; }
+    bool operator>(const Iterator &it) const { return idx_ > it.idx_; }
+    bool operator<=(const Iterator &it) const { return idx_ <= it.idx_; }
+    bool operator>=(const Iterator &it) const { return idx_ >= it.idx_; }
+
+   private:
+    // integers wrap through uint64_t so that negative steps and mixed
+    // signedness give the exact value
+    T At(difference_type idx) const {
+      if constexpr (std::is_integral_v<T>) {
+        return static_cast<T>(static_cast<uint64_t>(start_) +
+                              static_cast<uint64_t>(idx) *
+                                  static_cast<uint64_t>(step_));
+      } else {
+        return static_cast<T>(start_ + idx * step_);
+      }
+    }
+
+    T start_;
+    Step step_;
+    difference_type idx_;
+  };
+
+  StepRange(T start, T stop, Step step)
+      : start_(start), step_(step), size_(Size(start, stop, step)) {}
+
+  Iterator begin() const { return Iterator(start_, step_, 0); }
+  Iterator end() const {
+    return Iterator(start_, step_, static_cast<std::ptrdiff_t>(size_));
+  }
+  [[nodiscard]] size_t size() const { return size_; }
+
+ private:
+  static size_t Size(T start, T stop, Step step) {
+    assert(step != 0);
+    bool up = step > 0;
+    if (up ? !(start < stop) : !(stop < start)) return 0;
+    if constexpr (std::is_integral_v<T>) {
+      uint64_t dist = up ? static_cast<uint64_t>(stop) -
+                               static_cast<uint64_t>(start)
+                         : static_cast<uint64_t>(start) -
+                               static_cast<uint64_t>(stop);
+      uint64_t stride = up ? static_cast<uint64_t>(step)
+                           : uint64_t(0) - static_cast<uint64_t>(step);
+      return static_cast<size_t>(dist / stride + (dist % stride != 0));
+    } else {
+      return static_cast<size_t>(std::ceil((stop - start) / step));
+    }
+  }
+
+  T start_;
+  Step step_;
+  size_t size_;
+};
+
+template <typename T, typename Step>
+inline constexpr bool is_arithmetic_step_v =
+    std::is_arithmetic_v<T> &&std::is_arithmetic_v<Step>;
+
+template <
+    typename T, typename Step,
+    std::enable_if_t<!is_arithmetic_step_v<T, Step> &&
+                         std::is_same_v<T, decltype(std::declval<T>() +
+                                                    std::declval<Step>())>,
+                     int> = 0>
 StepRange(T, T, Step)
     ->StepRange<T, std::function<bool(const T &)>, std::function<void(T *)>>;
 
+template <
+    typename T, typename Step,
+    std::enable_if_t<is_arithmetic_step_v<T, Step> &&
+                         std::is_same_v<T, decltype(std::declval<T>() +
+                                                    std::declval<Step>())>,
+                     int> = 0>
+StepRange(T, T, Step)->StepRange<T, void, Step>;
+
 template <typename T, typename StepFunc,
           std::enable_if_t<std::is_invocable_r_v<void, StepFunc, T *>, int> = 0>
 StepRange(T, T, StepFunc)
@@ -4,87 +4,126 @@
 #ifndef TOYS_STREAM_STREAM_H_
 #define TOYS_STREAM_STREAM_H_
 
+#include <algorithm>
 #include <functional>
 #include <memory>
+#include <memory_resource>
 #include <optional>
-#include <queue>
+#include <iterator>
 #include <utility>
 #include <vector>
 
+#include "./cache.h"
+#include "./generator.h"
+#include "./multi_range.h"
+#include "./parallel.h"
+#include "./profile.h"
 #include "./sink.h"
 #include "./step_range.h"
 
+template <typename R, typename T>
+class PreparedStream;
+
 template <typename R, typename T = std::decay_t<decltype(
                           *std::declval<std::remove_pointer_t<R>>().begin())>>
 class Stream {
  public:
-  template <typename, typename, typename>
-  friend class CastSink;
   template <typename, typename>
   friend class Stream;
+  template <typename, typename>
+  friend class PreparedStream;
+  template <typename, typename>
+  friend class StreamCache;
 
+  using Source = std::remove_pointer_t<R>;
+
+  // Pulls source elements through the chain only until one reaches the
+  // PullSink at its end, so nothing is buffered unless a stage expands. A
+  // stream with a Handoff() fills the PullSink on another thread, so it is
+  // run to the end first.
   class Iterator {
    public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+    using pointer = T *;
+    using reference = T &;
+
     explicit Iterator(Stream<R, T> *stream)
         : stop_(false),
-          stream_(stream),
-          head_(static_cast<Sink<value_type_of<R>> *>(
+          eager_(stream->pipelined_),
+          head_(static_cast<Sink<value_type_of<Source>> *>(
               stream->sinks_[0]->Reciever())),
-          it_(stream_->range_.begin()) {
-      stream_->sinks_.emplace_back(
-          std::make_unique<ForEachSink<T, std::function<void(const T &)>>>(
-              [&buf = buf_](const T &val) { buf.emplace(val); }));
-      stream_->MakeChain();
-      head_->Pre(stream_->range_.size());
+          it_(stream->source().begin()),
+          end_(stream->source().end()) {
+      auto sink = stream->template MakeSink<PullSink<T>>();
+      sink_ = sink.get();
+      stream->Append(&stream->sinks_, "Iterator", std::move(sink));
+      LinkChain(&stream->sinks_);
+      head_->Pre(SourceExtent(stream->source()));
       LoadNext();
     }
     explicit Iterator(std::nullptr_t)
-        : stop_(false), stream_(nullptr), head_(nullptr), it_() {}
-    bool operator==(const Iterator &it) const {
-      if (it.stream_ == nullptr) {
-        if (stream_ == nullptr) return true;
-        return buf_.empty() && stop_;
-      }
-      // not expected
-      return true;
-    }
+        : stop_(true),
+          eager_(false),
+          head_(nullptr),
+          sink_(nullptr),
+          it_(),
+          end_() {}
+    bool operator==(const Iterator &it) const { return done() == it.done(); }
     bool operator!=(const Iterator &it) const { return !operator==(it); }
-    T &operator*() { return buf_.front(); }
-    T *operator->() { return &buf_.front(); }
-    T &operator++() {
-      buf_.pop();
+    T &operator*() { return sink_->front(); }
+    T *operator->() { return &sink_->front(); }
+    Iterator &operator++() {
+      sink_->Pop();
       LoadNext();
-      return buf_.front();
+      return *this;
     }
     T operator++(int) {
-      T tmp = buf_.front();
+      T tmp = std::move(sink_->front());
       ++*this;
       return tmp;
     }
 
    private:
+    [[nodiscard]] bool done() const {
+      return stop_ && (sink_ == nullptr || sink_->empty());
+    }
     void LoadNext() {
-      while (buf_.empty()) {
-        if (stop_) return;
-        if (it_ == stream_->range_.end()) {
+      while ((eager_ || sink_->empty()) && !stop_) {
+        if (it_ == end_ || head_->Cancelled()) {
           head_->Post();
           stop_ = true;
-          return;
+        } else {
+          head_->Accept(*it_);
+          ++it_;
         }
-        head_->Accept(*it_);
-        ++it_;
       }
     }
 
     bool stop_;
-    Stream<R, T> *stream_;
-    Sink<value_type_of<R>> *head_;
-    std::decay_t<decltype(std::declval<std::remove_pointer_t<R>>().begin())>
-        it_;
-    std::queue<T> buf_;
+    bool eager_;
+    Sink<value_type_of<Source>> *head_;
+    PullSink<T> *sink_;
+    decltype(std::declval<Source &>().begin()) it_;
+    decltype(std::declval<Source &>().end()) end_;
   };
 
-  explicit Stream(R &&range) : range_(std::move(range)) {
+  // Stages and the chain are allocated from `resource`; pass a StreamArena to
+  // build the whole pipeline in one block.
+  explicit Stream(
+      R &&range,
+      std::pmr::memory_resource *resource = std::pmr::get_default_resource())
+      : range_(std::move(range)),
+        resource_(resource),
+        sinks_(resource),
+        threads_(1),
+        ordered_(true),
+        pipelined_(false),
+        flags_(0),
+        order_(nullptr),
+        sort_stage_(0),
+        profile_(nullptr) {
     using Container = std::remove_pointer_t<R>;
     using U = value_type_of<Container>;
     static_assert(
@@ -95,7 +134,8 @@ class Stream {
     static_assert(
         std::is_convertible_v<
             std::decay_t<decltype(std::declval<Container>().size())>, size_t>);
-    sinks_.emplace_back(std::make_unique<HeadSink<T>>());
+    sinks_.reserve(kReservedStages);
+    sinks_.emplace_back(MakeSink<HeadSink<T>>());
   }
   Stream(const Stream &) = delete;
   Stream(Stream &&) = default;
@@ -106,77 +146,222 @@ class Stream {
             std::enable_if_t<std::is_same_v<T, U>, int> = 0>
   Stream Map(Func func) {
     static_assert(std::is_invocable_r_v<T, Func, const T &>);
-    sinks_.emplace_back(std::make_unique<MapSink<T, Func>>(std::move(func)));
+    Append(&sinks_, "Map", MakeSink<MapSink<T, Func>>(std::move(func)));
+    flags_ = 0;
     return std::move(*this);
   }
   template <typename Func,
             typename U = std::decay_t<std::invoke_result_t<Func, const T &>>,
             std::enable_if_t<!std::is_same_v<T, U>, int> = 0>
   Stream<R, U> Map(Func func) {
-    auto cast = std::make_unique<CastSink<R, T, U>>(std::move(*this));
-    auto &elder = cast->stream();
-    elder.sinks_.emplace_back(std::make_unique<MapObjSink<R, T, U, Func>>(
-        cast.get(), std::move(func)));
-    elder.MakeChain();
-    Stream<R, U> stream(std::move(elder.range_), std::move(cast));
-    return stream;
+    auto cast = MakeSink<CastSink<T, U>>(std::move(sinks_));
+    Append(&cast->sinks(), "Map",
+           MakeSink<MapObjSink<T, U, Func>>(cast.get(), std::move(func)));
+    LinkChain(&cast->sinks());
+    return Stream<R, U>(std::move(*this), std::move(cast));
   }
   template <typename Func,
             typename U = value_type_of<std::invoke_result_t<Func, const T &>>,
             std::enable_if_t<std::is_same_v<T, U>, int> = 0>
   Stream FlatMap(Func func) {
-    sinks_.emplace_back(
-        std::make_unique<FlatMapSink<T, Func>>(std::move(func)));
+    Append(&sinks_, "FlatMap",
+           MakeSink<FlatMapSink<T, Func>>(std::move(func)));
+    flags_ = 0;
     return std::move(*this);
   }
   template <typename Func,
             typename U = value_type_of<std::invoke_result_t<Func, const T &>>,
             std::enable_if_t<!std::is_same_v<T, U>, int> = 0>
   Stream<R, U> FlatMap(Func func) {
-    auto cast = std::make_unique<CastSink<R, T, U>>(std::move(*this));
-    auto &elder = cast->stream();
-    elder.sinks_.emplace_back(std::make_unique<FlatMapObjSink<R, T, U, Func>>(
-        cast.get(), std::move(func)));
-    elder.MakeChain();
-    Stream<R, U> stream(std::move(elder.range_), std::move(cast));
-    return stream;
+    auto cast = MakeSink<CastSink<T, U>>(std::move(sinks_));
+    Append(&cast->sinks(), "FlatMap",
+           MakeSink<FlatMapObjSink<T, U, Func>>(cast.get(), std::move(func)));
+    LinkChain(&cast->sinks());
+    return Stream<R, U>(std::move(*this), std::move(cast));
   }
   template <typename Func>
   Stream Filter(Func func) {
     static_assert(std::is_invocable_r_v<bool, Func, const T &>);
-    sinks_.emplace_back(std::make_unique<FilterSink<T, Func>>(std::move(func)));
+    Append(&sinks_, "Filter", MakeSink<FilterSink<T, Func>>(std::move(func)));
     return std::move(*this);
   }
   template <typename Func>
   Stream Peek(Func func) {
     static_assert(std::is_invocable_v<Func, const T &>);
-    sinks_.emplace_back(std::make_unique<PeekSink<T, Func>>(std::move(func)));
+    Append(&sinks_, "Peek", MakeSink<PeekSink<T, Func>>(std::move(func)));
     return std::move(*this);
   }
+  // Large buffers are sorted on the threads given to an earlier Parallel().
+  // Streams already sorted by the same comparator type, with no state, are
+  // left as they are.
   template <typename Less = std::less<T>>
   Stream Sort(Less less = Less()) {
     static_assert(std::is_invocable_r_v<bool, Less, const T &, const T &>);
-    sinks_.emplace_back(std::make_unique<SortSink<T, Less>>(std::move(less)));
+    if (SortedBy<Less>()) return std::move(*this);
+    Append(&sinks_, "Sort",
+           MakeSink<SortSink<T, Less>>(std::move(less), false, threads_));
+    SetSorted<Less>(true);
+    return std::move(*this);
+  }
+  // Sort() by key(element) < key(element). Arithmetic keys, like those of
+  // Sort() over numbers, are radix sorted.
+  template <typename Key>
+  Stream SortBy(Key key) {
+    static_assert(std::is_invocable_v<Key, const T &>);
+    return Sort(ByKey<Key>{std::move(key)});
+  }
+  // Sort() keeping equal elements in encounter order.
+  template <typename Less = std::less<T>>
+  Stream StableSort(Less less = Less()) {
+    static_assert(std::is_invocable_r_v<bool, Less, const T &, const T &>);
+    if (SortedBy<Less>()) return std::move(*this);
+    Append(&sinks_, "StableSort",
+           MakeSink<SortSink<T, Less>>(std::move(less), true, threads_));
+    SetSorted<Less>(true);
+    return std::move(*this);
+  }
+  // Sort() keeping only about `budget` bytes of elements in memory: sorted
+  // runs beyond that are spilled to temporary files, written by `serializer`,
+  // and merged on the way out.
+  template <typename Less = std::less<T>,
+            typename Serializer = RawSerializer<T>>
+  Stream ExternalSort(size_t budget, Less less = Less(),
+                      Serializer serializer = Serializer()) {
+    static_assert(std::is_invocable_r_v<bool, Less, const T &, const T &>);
+    if (SortedBy<Less>()) return std::move(*this);
+    Append(&sinks_, "ExternalSort",
+           MakeSink<ExternalSortSink<T, Less, Serializer>>(
+               budget, std::move(less), std::move(serializer)));
+    SetSorted<Less>(true);
+    return std::move(*this);
+  }
+  // Splits the source across `threads` workers, all hardware threads by
+  // default, if its iterators are random access or it can Split() itself on
+  // record boundaries, like MappedFile::Lines(). Stateless stages run on every
+  // worker over its own chunk, so their functions must be thread-safe; the
+  // first stage that needs the whole stream runs here over the chunks' output.
+  // Unordered streams may Collect, ForEach and FindFirst out of encounter
+  // order, and Reduce with a function that is not commutative.
+  Stream Parallel(bool ordered = true, size_t threads = 0) {
+    threads_ = threads == 0 ? HardwareThreads() : threads;
+    ordered_ = ordered;
+    return std::move(*this);
+  }
+  // Runs the stages added after this call on a thread of their own, fed by
+  // this one through a lock-free ring of `batches` batches, so that heavy
+  // stages on either side, like parsing and scoring, work at the same time
+  // even where the source cannot be split. The functions of later stages are
+  // called on that thread, in encounter order; a parallel stream is gathered
+  // in order first.
+  Stream Handoff(size_t batches = kHandoffBatches) {
+    Append(&sinks_, "Handoff", MakeSink<HandoffSink<T>>(batches));
+    pipelined_ = true;
+    return std::move(*this);
+  }
+  // Records what every stage added after this call does into `profile`, see
+  // PipelineProfile::Explain(). Streams that are not profiled pay nothing.
+  Stream Profile(PipelineProfile *profile) {
+    profile->clear();
+    profile_ = profile;
+    sort_stage_ = 0;
+    return std::move(*this);
+  }
+  // Same as Sort(less).Limit(k), which is fused into it.
+  template <typename Less = std::less<T>>
+  Stream TopK(size_t k, Less less = Less()) {
+    static_assert(std::is_invocable_r_v<bool, Less, const T &, const T &>);
+    Append(&sinks_, "TopK", MakeSink<TopKSink<T, Less>>(k, std::move(less)));
+    SetSorted<Less>(false);
     return std::move(*this);
   }
   Stream Limit(size_t max) {
-    sinks_.emplace_back(std::make_unique<LimitSink<T>>(max));
+    if (auto fused = sinks_.back()->FuseLimit(max, resource_)) {
+      sinks_.back() = std::move(fused);
+      sort_stage_ = 0;
+      if (profile_ != nullptr && !profile_->stages().empty()) {
+        profile_->back().name = "TopK";
+      }
+    } else {
+      Append(&sinks_, "Limit", MakeSink<LimitSink<T>>(max));
+    }
     return std::move(*this);
   }
   Stream Skip(size_t skip) {
-    sinks_.emplace_back(std::make_unique<SkipSink<T>>(skip));
+    Append(&sinks_, "Skip", MakeSink<SkipSink<T>>(skip));
     return std::move(*this);
   }
+  // Left out if the stream is distinct already, and compares neighbours
+  // instead of hashing if it is sorted in natural order.
   template <typename Hash = std::hash<T>>
   Stream Distinct(Hash hash = Hash()) {
     static_assert(std::is_invocable_r_v<size_t, Hash, const T &>);
-    sinks_.emplace_back(
-        std::make_unique<DistinctSink<T, Hash>>(std::move(hash)));
+    if ((flags_ & kDistinct) != 0) return std::move(*this);
+    if (SortedBy<std::less<T>>()) {
+      Append(&sinks_, "Distinct", MakeSink<AdjacentDistinctSink<T>>());
+    } else {
+      Append(&sinks_, "Distinct",
+             MakeSink<DistinctSink<T, Hash>>(std::move(hash)));
+    }
+    flags_ |= kDistinct;
     return std::move(*this);
   }
+  // Hash join with `other`, a range or a pointer to one as taken by Stream():
+  // every element is passed on as combine(element, row) for each row of
+  // `other` with rkey(row) == lkey(element), in the order of `other`. The
+  // rows are indexed by a hash table, built in partitions on the threads of an
+  // earlier Parallel(); if the stream is sized and shorter than `other`, the
+  // stream is indexed instead and the output follows the order of `other`.
+  template <typename Other, typename LKey, typename RKey, typename Combine,
+            typename K = std::decay_t<std::invoke_result_t<LKey, const T &>>,
+            typename Hash = std::hash<K>>
+  auto Join(Other other, LKey lkey, RKey rkey, Combine combine,
+            Hash hash = Hash()) {
+    return JoinWith<false>(std::move(other), std::move(lkey), std::move(rkey),
+                           std::move(combine), std::move(hash));
+  }
+  // Join() that also passes on elements without rows. `combine` takes a
+  // pointer to the row, nullptr for those elements; they come last if the
+  // stream is indexed.
+  template <typename Other, typename LKey, typename RKey, typename Combine,
+            typename K = std::decay_t<std::invoke_result_t<LKey, const T &>>,
+            typename Hash = std::hash<K>>
+  auto LeftJoin(Other other, LKey lkey, RKey rkey, Combine combine,
+                Hash hash = Hash()) {
+    return JoinWith<true>(std::move(other), std::move(lkey), std::move(rkey),
+                          std::move(combine), std::move(hash));
+  }
+  // Windows of `size` elements starting every `slide` elements, each passed
+  // on as a pair of the position of its first element and the accumulator of
+  // `agg`, one of those in aggregate.h, over its elements. Windows are
+  // aggregated pane by pane as the elements come, so an unbounded stream is
+  // never buffered; windows need the stream in order, so a parallel one is
+  // gathered first.
+  template <typename Agg>
+  auto SlidingWindow(size_t size, size_t slide, Agg agg) {
+    return Window<void>(nullptr, size, slide, std::move(agg));
+  }
+  template <typename Agg>
+  auto TumblingWindow(size_t size, Agg agg) {
+    return SlidingWindow(size, size, std::move(agg));
+  }
+  // SlidingWindow() over the integral key(element) of a stream ordered by it,
+  // like a timestamp: a window holds the elements with keys in [start, start +
+  // width) and is passed on once an element with a later key shows up, or the
+  // stream ends.
+  template <typename Key, typename Agg,
+            typename K = std::decay_t<std::invoke_result_t<Key, const T &>>>
+  auto SlidingWindowBy(Key key, K width, K slide, Agg agg) {
+    static_assert(std::is_integral_v<K>);
+    return Window<Key>(std::move(key), width, slide, std::move(agg));
+  }
+  template <typename Key, typename Agg,
+            typename K = std::decay_t<std::invoke_result_t<Key, const T &>>>
+  auto TumblingWindowBy(Key key, K width, Agg agg) {
+    return SlidingWindowBy(std::move(key), width, width, std::move(agg));
+  }
   std::vector<T> Collect() {
-    auto *sink = new CollectSink<T>();
-    sinks_.emplace_back(std::unique_ptr<CollectSink<T>>(sink));
+    auto *sink = new (resource_) CollectSink<T>();
+    Append(&sinks_, "Collect", std::unique_ptr<CollectSink<T>>(sink));
     Evaluate();
     std::vector<T> vals(std::move(sink->vals()));
     return vals;
@@ -184,62 +369,360 @@ class Stream {
   template <typename Func>
   void ForEach(Func func) {
     static_assert(std::is_invocable_r_v<void, Func, const T &>);
-    sinks_.emplace_back(
-        std::make_unique<ForEachSink<T, Func>>(std::move(func)));
+    Append(&sinks_, "ForEach",
+           MakeSink<ForEachSink<T, Func>>(std::move(func), !ordered_));
     Evaluate();
   }
   template <typename Func>
   T Reduce(Func most) {
     static_assert(std::is_invocable_r_v<T, Func, const T &, const T &>);
-    auto *sink = new ReduceSink<T, Func>(std::move(most));
-    sinks_.emplace_back(std::unique_ptr<ReduceSink<T, Func>>(sink));
+    auto *sink = new (resource_) ReduceSink<T, Func>(std::move(most));
+    Append(&sinks_, "Reduce", std::unique_ptr<ReduceSink<T, Func>>(sink));
     Evaluate();
     return std::move(sink->val());
   }
   template <typename Func>
   std::optional<T> FindFirst(Func func) {
     static_assert(std::is_invocable_r_v<bool, Func, const T &>);
-    auto *sink = new FindFirstSink<T, Func>(std::move(func));
-    sinks_.emplace_back(std::unique_ptr<FindFirstSink<T, Func>>(sink));
+    auto *sink = new (resource_) FindFirstSink<T, Func>(std::move(func));
+    Append(&sinks_, "FindFirst",
+           std::unique_ptr<FindFirstSink<T, Func>>(sink));
     Evaluate();
-    return sink->Cancelled() ? std::optional<T>() : std::move(sink->val());
+    return sink->Cancelled() ? std::optional<T>(std::move(sink->val()))
+                             : std::optional<T>();
   }
+  // Takes the length of sized sources without iterating them. A sort at the
+  // end does not change the count, so it is dropped.
   size_t Count() {
-    auto *sink = new CountSink<T>();
-    sinks_.emplace_back(std::unique_ptr<CountSink<T>>(sink));
+    if (sort_stage_ != 0 && sort_stage_ + 1 == sinks_.size()) {
+      sinks_.pop_back();
+      if (profile_ != nullptr) {
+        sinks_.pop_back();
+        profile_->RemoveStage();
+      }
+    }
+    auto *sink = new (resource_) CountSink<T>();
+    Append(&sinks_, "Count", std::unique_ptr<CountSink<T>>(sink));
+    Evaluate();
+    return sink->cnt();
+  }
+  // Aggregates the elements of each key(element) with `agg`, one of those in
+  // aggregate.h, into a FlatHashMap from keys to accumulators.
+  template <typename Key, typename Agg,
+            typename K = std::decay_t<std::invoke_result_t<Key, const T &>>,
+            typename Hash = std::hash<K>>
+  auto GroupBy(Key key, Agg agg, Hash hash = Hash()) {
+    using S = GroupBySink<T, Key, Agg, Hash>;
+    auto *sink = new (resource_)
+        S(std::move(key), std::move(agg), std::move(hash), threads_);
+    Append(&sinks_, "GroupBy", std::unique_ptr<S>(sink));
+    Evaluate();
+    typename S::Map map(std::move(sink->map()));
+    return map;
+  }
+  template <typename Key>
+  auto CountBy(Key key) {
+    return GroupBy(std::move(key), Counting());
+  }
+  // Approximate number of distinct elements from a HyperLogLog sketch of
+  // 2^precision bytes, see hyperloglog.h.
+  template <typename Hash = std::hash<T>>
+  size_t CountDistinct(size_t precision = HyperLogLog::kDefaultPrecision,
+                       Hash hash = Hash()) {
+    static_assert(std::is_invocable_r_v<size_t, Hash, const T &>);
+    auto *sink =
+        new (resource_) CountDistinctSink<T, Hash>(precision, std::move(hash));
+    Append(&sinks_, "CountDistinct",
+           std::unique_ptr<CountDistinctSink<T, Hash>>(sink));
     Evaluate();
     return sink->cnt();
   }
 
+  // Evaluates the stream into a StreamCache, whose Replay() streams the
+  // elements again as often as needed without running the stages so far.
+  StreamCache<T> Cache() {
+    auto *sink = new (resource_) CollectSink<T>();
+    Append(&sinks_, "Cache", std::unique_ptr<CollectSink<T>>(sink));
+    Evaluate();
+    return StreamCache<T>(std::move(sink->vals()), Characteristics());
+  }
+  // Cache() keeping about `budget` bytes of elements in memory; the rest is
+  // spilled to a temporary file, written by `serializer`.
+  template <typename Serializer = RawSerializer<T>>
+  StreamCache<T, Serializer> Cache(size_t budget,
+                                   Serializer serializer = Serializer()) {
+    StreamCache<T, Serializer> cache(budget, std::move(serializer),
+                                     Characteristics());
+    Append(&sinks_, "Cache", MakeSink<CacheSink<T, Serializer>>(&cache));
+    Evaluate();
+    return cache;
+  }
+  // Ends the stream in a PreparedStream, which runs its stages over other
+  // ranges instead of the source, as many times as needed.
+  PreparedStream<R, T> Prepare() {
+    sinks_.emplace_back(MakeSink<RelaySink<T>>());
+    LinkChain(&sinks_);
+    return PreparedStream<R, T>(std::move(*this));
+  }
+
+#if defined(__cpp_impl_coroutine)
+  // Runs the stream lazily inside a Generator, which suspends after every
+  // element until its consumer asks for the next one.
+  Generator<T> Generate() { return Yield(std::move(*this)); }
+#endif
+
   Iterator begin() { return Iterator(this); }
   Iterator end() const { return Iterator(nullptr); }
   [[nodiscard]] size_t size() const { return 0; }
+  static constexpr bool kSized = false;
 
  private:
-  Stream(R &&range, std::unique_ptr<Sink<T>> &&sink)
-      : range_(std::move(range)) {
+  static constexpr size_t kChunksPerThread = 4;
+  static constexpr size_t kReservedStages = 8;
+  static constexpr size_t kHandoffBatches = 16;
+
+  template <typename V>
+  Stream(Stream<R, V> &&elder, std::unique_ptr<Sink<T>> &&sink)
+      : range_(std::move(elder.range_)),
+        resource_(elder.resource_),
+        sinks_(elder.resource_),
+        threads_(elder.threads_),
+        ordered_(elder.ordered_),
+        pipelined_(elder.pipelined_),
+        flags_(0),
+        order_(nullptr),
+        sort_stage_(0),
+        profile_(elder.profile_) {
+    sinks_.reserve(kReservedStages);
     sinks_.emplace_back(std::move(sink));
   }
-  void Evaluate() {
-    MakeChain();
+  Stream(R &&range, CachedCharacteristics cached) : Stream(std::move(range)) {
+    threads_ = cached.threads;
+    ordered_ = cached.ordered;
+    flags_ = cached.flags;
+    order_ = cached.order;
+  }
+  [[nodiscard]] CachedCharacteristics Characteristics() const {
+    return {threads_, ordered_, flags_, order_};
+  }
+  template <typename Less>
+  [[nodiscard]] bool SortedBy() const {
+    const void *order = OrderOf<T, Less>();
+    return (flags_ & kSorted) != 0 && order != nullptr && order == order_;
+  }
+  // A sort stage may be dropped again by Count(); TopK() may not.
+  template <typename Less>
+  void SetSorted(bool droppable) {
+    flags_ |= kSorted;
+    order_ = OrderOf<T, Less>();
+    sort_stage_ = droppable ? sinks_.size() - 1 : 0;
+  }
+#if defined(__cpp_impl_coroutine)
+  static Generator<T> Yield(Stream stream) {
+    for (auto it = stream.begin(); it != stream.end(); ++it) {
+      co_yield std::move(*it);
+    }
+  }
+#endif
+  template <bool Outer, typename Other, typename LKey, typename RKey,
+            typename Combine, typename Hash>
+  auto JoinWith(Other other, LKey lkey, RKey rkey, Combine combine,
+                Hash hash) {
+    using U = value_type_of<std::remove_pointer_t<Other>>;
+    using Row = std::conditional_t<Outer, const U *, const U &>;
+    using V = std::decay_t<std::invoke_result_t<Combine &, const T &, Row>>;
+    using S = JoinObjSink<T, V, Other, LKey, RKey, Combine, Hash, Outer>;
+    auto cast = MakeSink<CastSink<T, V>>(std::move(sinks_));
+    Append(&cast->sinks(), Outer ? "LeftJoin" : "Join",
+           MakeSink<S>(cast.get(), std::move(other), std::move(lkey),
+                       std::move(rkey), std::move(combine), std::move(hash),
+                       threads_));
+    LinkChain(&cast->sinks());
+    return Stream<R, V>(std::move(*this), std::move(cast));
+  }
+  template <typename KeyFunc, typename Key, typename K, typename Agg>
+  auto Window(Key key, K width, K slide, Agg agg) {
+    using S = WindowSink<T, K, KeyFunc, Agg>;
+    using V = typename S::V;
+    auto cast = MakeSink<CastSink<T, V>>(std::move(sinks_));
+    Append(&cast->sinks(), "Window",
+           MakeSink<S>(cast.get(), std::move(key), width, slide,
+                       std::move(agg)));
+    LinkChain(&cast->sinks());
+    return Stream<R, V>(std::move(*this), std::move(cast));
+  }
+  // Appends a stage to `chain`, after a probe if the stream is profiled.
+  template <typename V, typename S>
+  void Append(SinkChain<V> *chain, const char *name, std::unique_ptr<S> sink) {
+    if (profile_ != nullptr) {
+      chain->emplace_back(MakeSink<ProbeSink<V>>(profile_->AddStage(name)));
+    }
+    chain->emplace_back(std::move(sink));
+  }
+  template <typename S, typename... Args>
+  std::unique_ptr<S> MakeSink(Args &&... args) {
+    return std::unique_ptr<S>(new (resource_) S(std::forward<Args>(args)...));
+  }
+  Source &source() {
     if constexpr (std::is_pointer_v<R>) {
-      sinks_[0]->Evaluate(*range_);
+      return *range_;
     } else {
-      sinks_[0]->Evaluate(range_);
+      return range_;
     }
   }
-  void MakeChain() {
-    for (size_t i = 0; i + 1 < sinks_.size(); ++i) {
-      sinks_[i]->set_next(sinks_[i + 1].get());
+  void Evaluate() {
+    LinkChain(&sinks_);
+    Evaluate(source());
+  }
+  // One run of a prepared stream, ending in `terminal`.
+  template <typename Range>
+  void Run(const Range &range, Sink<T> *terminal) {
+    sinks_.back()->set_next(terminal);
+    Evaluate(range);
+  }
+  template <typename Range>
+  void Evaluate(const Range &range) {
+    if constexpr (is_random_access_v<decltype(range.begin())> ||
+                  is_splittable_v<Range>) {
+      if (threads_ > 1) {
+        EvaluateParallel(range);
+        return;
+      }
     }
+    sinks_[0]->Evaluate(range);
   }
+  // Ordered streams fork the chain per chunk and join the forks in chunk
+  // order; unordered ones fork it once per worker.
+  template <typename Range>
+  void EvaluateParallel(const Range &range) {
+    using V = value_type_of<Range>;
+    auto head = [](const SinkChain<T> &chain) {
+      return static_cast<Sink<V> *>(chain[0]->Reciever());
+    };
+    if constexpr (is_random_access_v<decltype(range.begin())>) {
+      auto first = range.begin();
+      size_t len = std::distance(first, range.end());
+      size_t chunks = std::min(len, threads_ * kChunksPerThread);
+      auto bound = [len, chunks](size_t chunk) { return len * chunk / chunks; };
+      RunForks(
+          Extent::Exactly(len), chunks, head,
+          [&](size_t chunk) {
+            return Extent::Exactly(bound(chunk + 1) - bound(chunk));
+          },
+          [&](Sink<V> *fork, size_t chunk) {
+            size_t lo = bound(chunk);
+            size_t hi = bound(chunk + 1);
+            if constexpr (is_contiguous_v<Range>) {
+              fork->PushBatch(std::data(range) + lo, hi - lo);
+            } else {
+              fork->Push(first + lo, first + hi);
+            }
+          });
+    } else {
+      auto parts = range.Split(threads_ * kChunksPerThread);
+      RunForks(
+          SourceExtent(range), parts.size(), head,
+          [&](size_t chunk) { return SourceExtent(parts[chunk]); },
+          [&](Sink<V> *fork, size_t chunk) {
+            fork->Push(parts[chunk].begin(), parts[chunk].end());
+          });
+    }
+  }
+  // push(fork, chunk) feeds a chunk of `extent(chunk)` elements to the head
+  // of a fork.
+  template <typename Head, typename ChunkExtent, typename Push>
+  void RunForks(Extent ext, size_t chunks, Head head, ChunkExtent extent,
+                Push push) {
+    head(sinks_)->Pre(ext);
+    if (!head(sinks_)->Cancelled()) {
+      std::vector<SinkChain<T>> forks(ordered_ ? chunks : threads_);
+      ParallelFor(chunks, threads_, [&](size_t worker, size_t chunk) {
+        auto &fork = forks[ordered_ ? chunk : worker];
+        if (fork.empty()) {
+          ForkChain(sinks_, &fork);
+          head(fork)->Pre(ordered_ ? extent(chunk) : Extent::Unknown());
+        }
+        push(head(fork), chunk);
+        head(fork)->EndChunk();
+      });
+      for (auto &fork : forks) {
+        if (!fork.empty()) head(sinks_)->Join(head(fork));
+      }
+    }
+    head(sinks_)->Post();
+  }
+
   R range_;
-  std::vector<std::unique_ptr<Sink<T>>> sinks_;
+  std::pmr::memory_resource *resource_;
+  SinkChain<T> sinks_;
+  size_t threads_;
+  bool ordered_;
+  // Whether a Handoff() runs stages on another thread.
+  bool pipelined_;
+  // Characteristics of the elements leaving the last stage, and the order
+  // they are sorted in if kSorted.
+  unsigned flags_;
+  const void *order_;
+  // Index of the last sort stage, or 0.
+  size_t sort_stage_;
+  PipelineProfile *profile_;
 };
 
-template <typename R, typename T, typename U>
-void *CastSink<R, T, U>::Reciever() {
-  return stream_.sinks_[0]->Reciever();
-}
+// The stages of a Stream, built and linked once, run over one range after
+// another, e.g. over many small batches where building the chain would cost
+// more than the work. Stateful stages start over in every run but keep their
+// buffers, and a Join keeps its index of the other side. Every terminal takes
+// a range, or a pointer to one, of the same elements as the source of the
+// Stream; that source is not read.
+template <typename R, typename T>
+class PreparedStream {
+ public:
+  explicit PreparedStream(Stream<R, T> &&stream) : stream_(std::move(stream)) {}
+
+  template <typename Range>
+  std::vector<T> Collect(const Range &range) {
+    CollectSink<T> sink;
+    Run(range, &sink);
+    return std::move(sink.vals());
+  }
+  template <typename Range, typename Func>
+  void ForEach(const Range &range, Func func) {
+    static_assert(std::is_invocable_r_v<void, Func, const T &>);
+    ForEachSink<T, Func> sink(std::move(func), !stream_.ordered_);
+    Run(range, &sink);
+  }
+  template <typename Range, typename Func>
+  T Reduce(const Range &range, Func most) {
+    static_assert(std::is_invocable_r_v<T, Func, const T &, const T &>);
+    ReduceSink<T, Func> sink(std::move(most));
+    Run(range, &sink);
+    return std::move(sink.val());
+  }
+  template <typename Range, typename Func>
+  std::optional<T> FindFirst(const Range &range, Func func) {
+    static_assert(std::is_invocable_r_v<bool, Func, const T &>);
+    FindFirstSink<T, Func> sink(std::move(func));
+    Run(range, &sink);
+    return sink.Cancelled() ? std::optional<T>(std::move(sink.val()))
+                            : std::optional<T>();
+  }
+  template <typename Range>
+  size_t Count(const Range &range) {
+    CountSink<T> sink;
+    Run(range, &sink);
+    return sink.cnt();
+  }
+
+ private:
+  template <typename Range>
+  void Run(const Range &range, Sink<T> *terminal) {
+    static_assert(
+        std::is_same_v<value_type_of<std::remove_pointer_t<Range>>,
+                       value_type_of<typename Stream<R, T>::Source>>);
+    stream_.Run(RangeOf(range), terminal);
+  }
+
+  Stream<R, T> stream_;
+};
 
 #endif  // TOYS_STREAM_STREAM_H_
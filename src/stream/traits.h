@@ -6,7 +6,10 @@
 #define TOYS_STREAM_TRAITS_H_
 
 #include <functional>
+#include <iterator>
 #include <tuple>
+#include <type_traits>
+#include <utility>
 
 template <typename T>
 struct remove_func_class {
@@ -79,6 +82,80 @@ inline constexpr bool is_container_of =
     std::is_same_v<T, std::decay_t<decltype(*std::declval<C>().end())>>
         &&std::is_convertible_v<decltype(std::declval<C>().size()), size_t>;
 
+template <typename It, typename = void>
+struct is_random_access : std::false_type {};
+template <typename It>
+struct is_random_access<
+    It, std::void_t<typename std::iterator_traits<It>::iterator_category>>
+    : std::is_base_of<std::random_access_iterator_tag,
+                      typename std::iterator_traits<It>::iterator_category> {};
+
+template <typename It>
+inline constexpr bool is_random_access_v = is_random_access<It>::value;
+
+template <typename It, typename = void>
+struct is_forward : std::false_type {};
+template <typename It>
+struct is_forward<
+    It, std::void_t<typename std::iterator_traits<It>::iterator_category>>
+    : std::is_base_of<std::forward_iterator_tag,
+                      typename std::iterator_traits<It>::iterator_category> {};
+
+template <typename It>
+inline constexpr bool is_forward_v = is_forward<It>::value;
+
+template <typename C, typename = void>
+struct is_contiguous : std::false_type {};
+template <typename C>
+struct is_contiguous<C, std::void_t<decltype(std::data(std::declval<C &>()))>>
+    : std::is_same<std::decay_t<decltype(std::data(std::declval<C &>()))>,
+                   const value_type_of<C> *> {};
+
+template <typename C>
+inline constexpr bool is_contiguous_v = is_contiguous<const C>::value;
+
+// Sources without random access iterators that can still cut themselves into
+// parts for a parallel Stream, like LineRange, have a Split(n) member.
+template <typename C, typename = void>
+struct is_splittable : std::false_type {};
+template <typename C>
+struct is_splittable<
+    C, std::void_t<decltype(std::declval<const C &>().Split(size_t()))>>
+    : std::true_type {};
+
+template <typename C>
+inline constexpr bool is_splittable_v = is_splittable<C>::value;
+
+// Ranges whose elements stay put while they are iterated, so a stage may keep
+// pointers to them instead of copies.
+template <typename C, typename = void>
+struct is_stable_range : std::false_type {};
+template <typename C>
+struct is_stable_range<
+    C, std::void_t<typename std::iterator_traits<
+           decltype(std::declval<const C &>().begin())>::iterator_category>>
+    : std::bool_constant<
+          std::is_base_of_v<std::forward_iterator_tag,
+                            typename std::iterator_traits<decltype(
+                                std::declval<const C &>().begin())>::
+                                iterator_category> &&
+          std::is_lvalue_reference_v<decltype(
+              *std::declval<const C &>().begin())>> {};
+
+template <typename C>
+inline constexpr bool is_stable_range_v = is_stable_range<C>::value;
+
+// Calls func(val) with `val` forwarded as an rvalue when `func` accepts one,
+// so functions taking their argument by value can steal it.
+template <typename Func, typename T>
+decltype(auto) InvokeForwarded(Func &func, T &&val) {
+  if constexpr (std::is_invocable_v<Func &, T &&>) {
+    return func(std::forward<T>(val));
+  } else {
+    return func(val);
+  }
+}
+
 template <typename T>
 struct template_traits;
 
@@ -0,0 +1,79 @@
+//
+// Copyright [2020] <inhzus>
+//
+#ifndef TOYS_STREAM_WINDOW_H_
+#define TOYS_STREAM_WINDOW_H_
+
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Floor of num / den for den > 0, also for negative num.
+template <typename K>
+K FloorDiv(K num, K den) {
+  if constexpr (std::is_signed_v<K>) {
+    return num / den - static_cast<K>(num % den < 0);
+  } else {
+    return num / den;
+  }
+}
+
+// The panes of the open windows of a windowed aggregation, oldest first, each
+// folded into one accumulator of Agg (see aggregate.h). Whole windows are
+// aggregated from two stacks: panes pushed since the last flip, and the older
+// ones, each of those holding the aggregate of itself and the panes after it.
+// So pushing, evicting and aggregating take O(1) merges on average, however
+// many panes a window spans.
+template <typename K, typename A, typename Agg>
+class PaneQueue {
+ public:
+  [[nodiscard]] bool empty() const { return front_.empty() && back_.empty(); }
+  void clear() {
+    front_.clear();
+    back_.clear();
+    back_acc_.reset();
+  }
+
+  void Push(const Agg &agg, K pane, A &&acc) {
+    if (back_acc_.has_value()) {
+      agg.Merge(*back_acc_, A(acc));
+    } else {
+      back_acc_.emplace(acc);
+    }
+    back_.emplace_back(pane, std::move(acc));
+  }
+  // Drops the panes before `pane`.
+  void Evict(const Agg &agg, K pane) {
+    while (!empty()) {
+      if (front_.empty()) Flip(agg);
+      if (front_.back().first >= pane) return;
+      front_.pop_back();
+    }
+  }
+  // The merged accumulators of all panes; the queue must not be empty.
+  A Aggregate(const Agg &agg) const {
+    if (front_.empty()) return *back_acc_;
+    A acc(front_.back().second);
+    if (back_acc_.has_value()) agg.Merge(acc, A(*back_acc_));
+    return acc;
+  }
+
+ private:
+  void Flip(const Agg &agg) {
+    while (!back_.empty()) {
+      auto &[pane, acc] = back_.back();
+      if (!front_.empty()) agg.Merge(acc, A(front_.back().second));
+      front_.emplace_back(pane, std::move(acc));
+      back_.pop_back();
+    }
+    back_acc_.reset();
+  }
+
+  // oldest pane last
+  std::vector<std::pair<K, A>> front_;
+  std::vector<std::pair<K, A>> back_;
+  std::optional<A> back_acc_;
+};
+
+#endif  // TOYS_STREAM_WINDOW_H_